@@ -1,11 +1,27 @@
 #include "config.h"
+#include "protodef.hpp"
 
-int usb_event_rx = 0;
+static_assert((USB_RX_SLOTS & (USB_RX_SLOTS - 1)) == 0);
+static_assert((USB_TX_QUEUE_SIZE & (USB_TX_QUEUE_SIZE - 1)) == 0);
 
-struct usb_data usb_rx;
+// packets are assembled into the slot at head by the USB receive path
+// and handled from the slot at tail by the main loop, each side
+// modifies only its own counter
+static struct usb_data usb_rx_slots[USB_RX_SLOTS];
+static volatile uint8_t usb_rx_head;
+static volatile uint8_t usb_rx_tail;
+
+// packets are appended at head by the main loop and taken from tail
+// by the USB transmit path, in pieces of up to one IN transfer
+static uint8_t usb_tx_queue[USB_TX_QUEUE_SIZE];
+static volatile uint16_t usb_tx_head;
+static volatile uint16_t usb_tx_tail;
 
 UART_HandleTypeDef huartx;
 
+DMA_HandleTypeDef hdma_uartx_rx;
+DMA_HandleTypeDef hdma_uartx_tx;
+
 /**
   * @brief UART Initialization Function
   * @param None
@@ -27,3 +43,128 @@ void uart_init(const USBD_CDC_LineCodingTypeDef *cdc_uart_config)
     Error_Handler();
   }
 }
+
+/**
+  * @brief Checks if there is a slot to assemble the next packet into
+  * @retval 1 when a slot is available, 0 otherwise
+  */
+int usb_rx_slot_free(void)
+{
+  return static_cast<uint8_t>(usb_rx_head - usb_rx_tail) < USB_RX_SLOTS;
+}
+
+/**
+  * @brief Appends USB data to the free slot until the packet is complete
+  * @param buf: data received from the USB OUT endpoint
+  * @param len: number of received bytes, greater than 0
+  * @note  Must be called only when usb_rx_slot_free() returns 1
+  * @retval number of bytes consumed from buf, when the packet
+  *         is complete the slot is handed over to usb_rx_peek
+  *         and the rest of buf belongs to the next packet
+  */
+uint32_t usb_rx_assemble(const uint8_t *buf, uint32_t len)
+{
+  struct usb_data &slot = usb_rx_slots[usb_rx_head % USB_RX_SLOTS];
+  uint32_t consumed = 0;
+
+  if(slot.len == 0)
+  {
+    slot.buf[common_length_pos] = buf[0];
+    slot.len = 1;
+    consumed = 1;
+  }
+
+  // malformed length is completed with the type byte
+  // and rejected by handle_command
+  const uint32_t packet_len = std::max<uint32_t>(slot.buf[common_length_pos], common_type_pos + 1);
+  const uint32_t chunk = std::min(packet_len - slot.len, len - consumed);
+
+  std::copy_n(buf + consumed, chunk, slot.buf + slot.len);
+  slot.len += chunk;
+  consumed += chunk;
+
+  if(slot.len == packet_len)
+    usb_rx_head = usb_rx_head + 1;
+
+  return consumed;
+}
+
+/**
+  * @brief Returns the oldest complete packet
+  * @retval packet or NULL when nothing was received
+  */
+struct usb_data *usb_rx_peek(void)
+{
+  if(usb_rx_head == usb_rx_tail)
+    return nullptr;
+  return &usb_rx_slots[usb_rx_tail % USB_RX_SLOTS];
+}
+
+/**
+  * @brief Frees the slot of the packet returned by usb_rx_peek
+  * @retval None
+  */
+void usb_rx_pop(void)
+{
+  usb_rx_slots[usb_rx_tail % USB_RX_SLOTS].len = 0;
+  usb_rx_tail = usb_rx_tail + 1;
+}
+
+/**
+  * @brief Drops all of the received packets
+  * @retval None
+  */
+void usb_rx_reset(void)
+{
+  for(auto &slot : usb_rx_slots)
+    slot.len = 0;
+  usb_rx_head = 0;
+  usb_rx_tail = 0;
+}
+
+/**
+  * @brief Queues a packet for the USB IN endpoint without waiting
+  * @param buf: packet to send
+  * @param len: packet length
+  * @param reserve: number of bytes which have to stay free afterwards
+  * @retval 1 when the whole packet was queued, 0 when it was dropped
+  */
+int usb_tx_push(const uint8_t *buf, uint32_t len, uint32_t reserve)
+{
+  const uint16_t head = usb_tx_head;
+  const uint16_t used = static_cast<uint16_t>(head - usb_tx_tail);
+  if(len + reserve > static_cast<uint32_t>(USB_TX_QUEUE_SIZE - used))
+    return 0;
+
+  for(uint32_t i = 0; i < len; i++)
+    usb_tx_queue[(head + i) % USB_TX_QUEUE_SIZE] = buf[i];
+  usb_tx_head = head + len;
+  return 1;
+}
+
+/**
+  * @brief Moves the oldest queued bytes out of the queue
+  * @param buf: destination, usually the buffer of the next IN transfer
+  * @param len: size of buf
+  * @retval number of bytes copied, packets may be split between calls
+  */
+uint32_t usb_tx_take(uint8_t *buf, uint32_t len)
+{
+  const uint16_t tail = usb_tx_tail;
+  const uint32_t count = std::min<uint32_t>(static_cast<uint16_t>(usb_tx_head - tail), len);
+
+  for(uint32_t i = 0; i < count; i++)
+    buf[i] = usb_tx_queue[(tail + i) % USB_TX_QUEUE_SIZE];
+  usb_tx_tail = tail + count;
+  return count;
+}
+
+/**
+  * @brief Drops all of the queued data
+  * @retval None
+  */
+void usb_tx_reset(void)
+{
+  usb_tx_head = 0;
+  usb_tx_tail = 0;
+}
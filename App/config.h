@@ -10,6 +10,20 @@
 #include "flasher.h"
 
 #define CURRENT_UART USART1
+// number of packets buffered between the USB OUT endpoint and
+// handle_command, must be a power of two
+#define USB_RX_SLOTS 4
+// bytes queued for the USB IN endpoint, must be a power of two
+#define USB_TX_QUEUE_SIZE 1024
+// space kept for responses, logs are dropped instead of using it
+#define USB_TX_RESERVED 64
+// BULK_WRITE data kept by the bridge until it's written to the target,
+// must be a power of two
+#if defined(STM32F303xC)
+#define STAGING_SIZE (16 * 1024)
+#else
+#define STAGING_SIZE (8 * 1024)
+#endif
 
 struct usb_data
 {
@@ -17,13 +31,21 @@ struct usb_data
   uint8_t len;
 };
 
-extern int usb_event_rx;
-extern struct usb_data usb_rx;
 extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 extern UART_HandleTypeDef huartx;
+extern DMA_HandleTypeDef hdma_uartx_rx;
+extern DMA_HandleTypeDef hdma_uartx_tx;
 
 
 void uart_init(const USBD_CDC_LineCodingTypeDef *cdc_uart_config);
+uint32_t usb_rx_assemble(const uint8_t *buf, uint32_t len);
+int usb_rx_slot_free(void);
+struct usb_data *usb_rx_peek(void);
+void usb_rx_pop(void);
+void usb_rx_reset(void);
+int usb_tx_push(const uint8_t *buf, uint32_t len, uint32_t reserve);
+uint32_t usb_tx_take(uint8_t *buf, uint32_t len);
+void usb_tx_reset(void);
 
 #ifdef __cplusplus
 #pragma GCC diagnostic pop
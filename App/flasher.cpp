@@ -2,361 +2,1248 @@ extern "C" {
 #include "flasher.h"
 #include "usbd_cdc_if.h"
 }
-#include <stdarg.h>
 #include "config.h"
 #include "ring_buffer.hpp"
 
 #include "proto.hpp"
-constexpr int uart_timeout_ms = 3000;
+#include "crc.hpp"
+#include "log.hpp"
+#include "lz.hpp"
 stm32_config stm_configuration;
 
-uint8_t uart_rx_token;
+// Time budgets of the bootloader answers in microseconds, the time
+// needed to transfer the command and the answer is added to them.
+// Commands are answered right away, writing and erasing take longer
+constexpr uint32_t stm32_ack_timeout_us        = 100'000;
+constexpr uint32_t stm32_write_timeout_us      = 100'000;
+constexpr uint32_t stm32_erase_page_timeout_us = flash_page_erase_timeout_ms * 1000;
+constexpr uint32_t stm32_mass_erase_timeout_us = flash_mass_erase_timeout_ms * 1000;
+constexpr uint32_t stm32_checksum_timeout_us   = 1'000'000;
+
+// must hold the longest bootloader answer (Read Memory) with a margin,
+// the DMA wraps around so the data has to be consumed before it's overwritten
+constexpr uint16_t uart_rx_dma_size = 512;
+static uint8_t uart_rx_dma_buf[uart_rx_dma_size];
+static uint16_t uart_rx_tail;
+// set on idle line, half and full transfer of the rx DMA
+static volatile bool uart_rx_event;
+// bytes of the last transfer, the answer can't come before they are sent
+static uint32_t uart_tx_pending;
+
+// a whole bootloader transfer is gathered here and sent by a single DMA
+// request, the largest one is Write Memory: N-1, 256 bytes and checksum
+constexpr uint16_t uart_tx_dma_size = 260;
+static uint8_t uart_tx_dma_buf[uart_tx_dma_size];
+
+// the bootloader answers an erase only after all listed pages are done,
+// smaller commands let a failure show up sooner
+constexpr uint16_t erase_pages_per_cmd = 32;
+
+// the most Read Memory returns in a single command
+constexpr uint16_t read_memory_max_size = 256;
+
+// sequence number of the next FRAME we accept, reset by INIT
+static uint8_t expected_frame_seq;
+
+// the most a single Write Memory command takes
+constexpr uint16_t write_memory_max_size = 256;
+
+// FRAME and BULK_WRITE blocks are ACKed once their data is in the staging
+// buffer and written to the target from there by flasher_poll, so the USB
+// packets keep coming while the UART is busy. Other packets are handled
+// only after all of the staged data is written
+static_assert((STAGING_SIZE & (STAGING_SIZE - 1)) == 0);
+static_assert(flash_bulk_write_max_size <= STAGING_SIZE);
+
+struct staged_block
+{
+  uint32_t addr;
+  uint16_t size;
+  uint8_t seq;
+};
 
-ring_buffer<300, uint8_t> rx_queue;
+// data of the staged blocks in their order, the counters run freely
+static uint8_t staging[STAGING_SIZE];
+static uint32_t staging_head;
+static uint32_t staging_tail;
+// blocks waiting to be written, the first one is taken to staging_block
+static ring_buffer<17, staged_block> staged_blocks;
+static staged_block staging_block;
+static uint16_t staging_block_left;
+// set when a write fails, the rest of the staged data is dropped and
+// everything but INIT is NACKed
+static bool staging_failed;
+
+// block which is being received, left counts the bytes of its stream
+// for COMPRESSED_WRITE
+static bool bulk_write_active;
+static bool bulk_write_compressed;
+static uint8_t bulk_write_seq;
+static uint16_t bulk_write_left;
+
+// compressed blocks are decompressed straight into the staging buffer,
+// the bytes the matches refer to are still there
+static_assert(lz_window_size <= STAGING_SIZE);
+static lz_decoder bulk_write_decoder;
+
+// The bootloader flows are state machines stepped by flasher_poll, so the
+// main loop keeps moving USB packets while the target works. Each state
+// waits for a single thing: the end of a pin delay or an answer
+enum class flasher_state : uint8_t
+{
+  IDLE,
+  PINS,         // boot and reset pins are driven, each change is held for a while
+  SYNC,         // 0x7F sent, waits for ACK
+  GET,          // Get sent, waits for ACK and the number of commands
+  GET_COMMANDS, // waits for the version, the commands and ACK
+  ERASE_CMD,    // Erase sent, waits for ACK
+  ERASE_PAGES,  // a batch of pages sent, waits for ACK
+  ERASE_ALL,    // mass erase sent, waits for ACK
+  WRITE_CMD,    // Write Memory sent, waits for ACK
+  WRITE_ADDR,   // address sent, waits for ACK
+  WRITE_DATA,   // data sent, waits for ACK
+};
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+// command the host is answered for once the flow is done, NONE for the
+// staged writes and for the reset after a failed INIT
+enum class flasher_job : uint8_t
 {
-  rx_queue.push_no_wait(uart_rx_token); 
-  HAL_UART_Receive_IT(&huartx, &uart_rx_token, 1);
+  NONE,
+  INIT,
+  RESET,
+  ERASE,
+  PAGE_CHECK,
+};
+
+static flasher_state state = flasher_state::IDLE;
+static flasher_job job = flasher_job::NONE;
+
+// the boot and reset pins are changed one at a time, each change is held
+// for pin_hold_us so the target sees it
+constexpr uint32_t pin_hold_us = 100'000;
+static uint8_t pins_step;
+static uint32_t pins_deadline;
+
+// erase requested by INIT, done once the bootloader commands are known
+static flash_erase_type init_erase_type;
+// pages which are still to be erased, or the whole flash
+static bool erase_all;
+static uint16_t erase_next_page;
+static uint16_t erase_pages_left;
+static uint16_t erase_batch;
+
+// Write Memory command which is in progress
+static uint8_t write_buf[write_memory_max_size];
+static uint16_t write_size;
+static uint32_t write_addr;
+static uint8_t write_seq;
+static uint8_t write_chksum;
+
+// messages above this level are dropped, selected by INIT. Until the
+// host asks for more only the failures follow the responses
+static flash_log_level log_verbosity = flash_log_level::ERROR;
+
+static constexpr flash_log_level log_levels[] = {
+#define FLASH_LOG_LEVEL(id, level, text) flash_log_level::level,
+  FLASH_LOG_MESSAGES(FLASH_LOG_LEVEL)
+#undef FLASH_LOG_LEVEL
+};
+static_assert(sizeof(log_levels) == static_cast<size_t>(log_id::COUNT), "Log level missing");
+
+// The CRC unit keeps crc of the FRAME payloads written since INIT, its
+// reset configuration is the one of crc.hpp. Other crc calculations
+// are done in software not to disturb it
+static void
+image_crc_reset()
+{
+  CRC->CR = CRC_CR_RESET;
 }
 
-void usb_transmit_msg(const char *format, ...)
+static void
+image_crc_update(const uint8_t *data, uint16_t size)
 {
-  const int attemps = 10;
-  int attempt = 0;
+  for(uint16_t i = 0; i + 4 <= size; i += 4)
+    CRC->DR = (uint32_t)data[i] | (uint32_t)data[i + 1] << 8 |
+              (uint32_t)data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+}
 
-  uint8_t packet_buf[flash_msg_length];
-  uint8_t payload[flash_msg_payload_length];
-  va_list args;
-  va_start(args, format);
-  int written = vsnprintf(reinterpret_cast<char*>(payload), flash_msg_length, format, args);
-  va_end(args);
+static uint32_t
+image_crc()
+{
+  return CRC->DR;
+}
 
-  if(written < 0 || written == max_packet_size)
-    return;
+static void
+stm32_rx_start()
+{
+  HAL_UART_AbortReceive(&huartx);
+  uart_rx_tail = 0;
+  uart_rx_event = false;
+  HAL_UARTEx_ReceiveToIdle_DMA(&huartx, uart_rx_dma_buf, uart_rx_dma_size);
+}
 
-  raw_packet packet(packet_buf, max_packet_size);
+// position in uart_rx_dma_buf where the DMA writes the next byte
+static uint16_t
+stm32_rx_head()
+{
+  uint16_t head = uart_rx_dma_size - __HAL_DMA_GET_COUNTER(huartx.hdmarx);
+  // the counter is reloaded in circular mode, but may be read as 0 for a while
+  return head == uart_rx_dma_size ? 0 : head;
+}
 
-  auto flash_msg_builder_opt = flash_msg_builder::make_flash_msg_builder(packet);
-  if(!flash_msg_builder_opt.has_value())
-    return; // this should never heppen
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+  // Size is the head at the time of the event only, the readers take
+  // it from the DMA counter to also see the bytes which came since
+  UNUSED(Size);
+  if(huart == &huartx)
+    uart_rx_event = true;
+}
 
-  auto flash_msg_builder = *flash_msg_builder_opt;
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  // HAL stops the reception on overrun or framing errors,
+  // data which was not read yet is not trustworthy anyway
+  if(huart == &huartx)
+    stm32_rx_start();
+}
 
-  if(!flash_msg_builder.copy_msg(payload, written+1))
+// Sends a message of log.hpp with its arguments, the text is
+// formatted by the host so no formatting is done here. The message is
+// dropped when the USB queue is short of space, responses go first
+static void
+usb_transmit_log_args(log_id id, const uint32_t *args, uint8_t count)
+{
+  if(log_levels[static_cast<uint8_t>(id)] > log_verbosity)
     return;
 
-  flash_msg msg = flash_msg(flash_msg_builder);
+  uint8_t packet_buf[flash_log_max_length];
+  raw_packet packet(packet_buf, flash_log_max_length);
 
-  while(CDC_Transmit_FS(msg.data(), msg.get_msg_size() + flash_msg_header_length) != USBD_OK && attempt < attemps)
-  {
-    HAL_Delay(50);
-    attempt++;
-  }
-};
+  auto flash_log_builder_opt = flash_log_builder::make_flash_log_builder(packet);
+  if(!flash_log_builder_opt.has_value())
+    return; // this should never heppen
+
+  auto flash_log_builder = *flash_log_builder_opt;
+  flash_log_builder.set_id(static_cast<uint8_t>(id));
+  for(uint8_t i = 0; i < count; i++)
+    flash_log_builder.add_arg(args[i]);
+
+  flash_log log = flash_log(flash_log_builder);
 
+  CDC_Send_FS(log.data(), log.size(), USB_TX_RESERVED);
+}
+
+template<typename... Args>
 static void
-usb_transmit_cmd_response(flash_response_type response)
+usb_transmit_log(log_id id, Args... args)
 {
-  const int attemps = 10;
-  int attempt = 0;
+  static_assert(sizeof...(args) <= flash_log_max_args, "Too many log arguments");
+  const uint32_t values[] = {static_cast<uint32_t>(args)..., 0};
+  usb_transmit_log_args(id, values, sizeof...(args));
+}
 
-  uint8_t packet_buf[flash_response_length];
-  raw_packet raw_packet(packet_buf, flash_response_length);
+static void
+usb_transmit_cmd_response(flash_response_type response, uint8_t seq = 0,
+                          std::optional<uint32_t> crc = std::nullopt)
+{
+  uint8_t packet_buf[flash_response_crc_length];
+  raw_packet raw_packet(packet_buf, flash_response_crc_length);
 
   auto flash_response_builder_opt = flash_response_builder::make_flash_response_builder(raw_packet);
   if(!flash_response_builder_opt.has_value())
   {
-    usb_transmit_msg("Sending response failed");
+    usb_transmit_log(log_id::RESPONSE_FAILED);
     return; // this should never heppen
   }
 
   auto flash_response_builder = *flash_response_builder_opt;
   flash_response_builder.set_response(response);
+  flash_response_builder.set_seq(seq);
+  if(crc.has_value())
+    flash_response_builder.set_crc(crc.value());
 
   flash_response response_packet(flash_response_builder);
 
-  while(CDC_Transmit_FS(response_packet.data(), response_packet.size()) != USBD_OK && attempt < attemps)
+  // lost only when the host stops reading, it sends the frames again then
+  CDC_Send_FS(response_packet.data(), response_packet.size(), 0);
+}
+
+// Time in microseconds taken from SysTick, which unlike the DWT cycle
+// counter keeps running while the core sleeps in WFI. Interrupts must be
+// enabled, so the tick is updated when the counter reloads
+static uint32_t
+stm32_time_us()
+{
+  uint32_t tick;
+  uint32_t count;
+  do
+  {
+    tick = HAL_GetTick();
+    count = SysTick->VAL;
+  } while(tick != HAL_GetTick());
+
+  const uint32_t load = SysTick->LOAD + 1;
+  return tick * 1000 + (load - count) * 1000 / load;
+}
+
+// Time of transferring count bytes over the UART: start bit,
+// 8 data bits, parity and stop bit
+static uint32_t
+stm32_transfer_us(uint32_t count)
+{
+  const uint32_t bitrate = huartx.Init.BaudRate;
+  return count * ((11 * 1'000'000 + bitrate - 1) / bitrate);
+}
+
+// Sleeps until ready returns true or the deadline passes. The UART and
+// DMA interrupts wake the core as soon as there is something to check,
+// SysTick wakes it at least every millisecond to check the deadline
+template<typename Ready>
+static bool
+stm32_wait(Ready ready, uint32_t deadline)
+{
+  while(!ready())
   {
-    HAL_Delay(50);
-    attempt++;
+    if(static_cast<int32_t>(stm32_time_us() - deadline) >= 0)
+      return false;
+
+    // an interrupt coming after the check still ends WFI,
+    // it is handled once interrupts are enabled again
+    __disable_irq();
+    if(!ready())
+      __WFI();
+    __enable_irq();
   }
+  return true;
 }
 
+// Reads count bytes of the answer, the whole answer must come within
+// timeout_us counted from the end of the last transfer
 static int
-stm32_read(uint8_t* buf, uint32_t count)
+stm32_read(uint8_t* buf, uint32_t count, uint32_t timeout_us)
 {
-  constexpr int attempts_init = 2000;
-  int attempts = attempts_init;
-  int counter = 0;
+  const uint32_t deadline = stm32_time_us() + timeout_us +
+                            stm32_transfer_us(uart_tx_pending + count);
+  uart_tx_pending = 0;
+
+  uint32_t counter = 0;
   while(counter < count)
   {
-    while(attempts > 0)
-    {
-      if(rx_queue.pop(buf+counter))
-      {
-        counter++;
-        break;
-      }
-      else
-      {
-        HAL_Delay(1);
-        attempts--;
-      }
-    }
-    if(attempts == 0)
+    if(!stm32_wait([] { return stm32_rx_head() != uart_rx_tail; }, deadline))
       return HAL_ERROR;
 
-    attempts = attempts_init;
+    const uint16_t head = stm32_rx_head();
+    while(uart_rx_tail != head && counter < count)
+    {
+      buf[counter++] = uart_rx_dma_buf[uart_rx_tail];
+      uart_rx_tail = (uart_rx_tail + 1) % uart_rx_dma_size;
+    }
   }
   return HAL_OK;
 }
 
+// Waits until the previous DMA transfer is done and returns
+// the buffer for the next one, nullptr on timeout
+static uint8_t*
+stm32_tx_acquire()
+{
+  const uint32_t deadline = stm32_time_us() + stm32_ack_timeout_us +
+                            stm32_transfer_us(uart_tx_pending);
+  if(!stm32_wait([] { return huartx.gState == HAL_UART_STATE_READY; }, deadline))
+  {
+    HAL_UART_AbortTransmit(&huartx);
+    return nullptr;
+  }
+  return uart_tx_dma_buf;
+}
+
+// Starts the DMA transfer of the data placed in the acquired buffer.
+// The function does not wait for the end of the transfer,
+// the bootloader answers only after receiving all of it.
+static int
+stm32_tx_commit(uint32_t count)
+{
+  uart_tx_pending = count;
+  return HAL_UART_Transmit_DMA(&huartx, uart_tx_dma_buf, count);
+}
+
 static int
 stm32_write(const uint8_t* buf, uint32_t count)
 {
-  return HAL_UART_Transmit(&huartx, (uint8_t*)buf, count, uart_timeout_ms);
+  uint8_t *tx = stm32_tx_acquire();
+  if(tx == nullptr || count > uart_tx_dma_size)
+    return HAL_ERROR;
+
+  std::copy_n(buf, count, tx);
+  return stm32_tx_commit(count);
+}
+
+stm32_config
+get_config()
+{
+  return stm_configuration;
 }
 
+// Finds the pages which are covered by the given range
 static bool
-stm32_init()
+image_pages(uint32_t addr, uint32_t size, uint32_t page_size,
+            uint16_t &first_page, uint16_t &count)
 {
-  constexpr int cmds_res_size = 12; // 11 commands + version
-  uint8_t commands[cmds_res_size];
-  uint8_t init_cmd = STM32_CMD_INIT;
-  uint8_t get_cmd[2] = {STM32_CMD_GET, STM32_CMD_GET^0xff};
-  uint8_t response=0x0;
-  if(stm32_write(&init_cmd, 1) != HAL_OK)
+  if(page_size == 0 || size == 0 || addr < STM32_FLASH_BASE)
   {
-      usb_transmit_msg("During stm32 config init write the uart error occured");
-      return false;
+    usb_transmit_log(log_id::IMAGE_RANGE_INCORRECT, addr, size, page_size);
+    return false;
   }
 
-  if(stm32_read(&response, 1) != HAL_OK)
+  const uint32_t first = (addr - STM32_FLASH_BASE) / page_size;
+  const uint32_t last = (addr - STM32_FLASH_BASE + size - 1) / page_size;
+
+  if(last > 0xffff)
   {
-      usb_transmit_msg("During stm32 config init read the uart error occured");
-      return false;
+    usb_transmit_log(log_id::IMAGE_EXCEEDS_FLASH, last);
+    return false;
   }
 
+  first_page = first;
+  count = last - first + 1;
+  return true;
+}
+
+// Reads count (1-256) bytes of the target memory using Read Memory command
+static bool
+stm32_read_memory(uint32_t addr, uint8_t *buf, uint16_t count)
+{
+  const uint8_t cmd[2] = {stm_configuration.rm, (uint8_t)(stm_configuration.rm^0xff)};
+  const uint8_t size[2] = {(uint8_t)(count-1), (uint8_t)((count-1)^0xff)};
+  uint8_t response=0x0;
+
+  if(stm32_write(cmd, 2) != HAL_OK)
+  {
+    usb_transmit_log(log_id::READ_MEMORY_UART_BUSY);
+    return false;
+  }
+  stm32_read(&response, 1, stm32_ack_timeout_us);
   if(response != STM32_ACK)
   {
-      usb_transmit_msg("Stm32 config error. Waiting for ACK failed %d != %d", STM32_ACK, response);
-      return false;
+    usb_transmit_log(log_id::READ_MEMORY_NACK, response);
+    return false;
   }
   response = 0x0;
 
-  if(stm32_write(get_cmd, 2) != HAL_OK)
+  // address goes MSB first followed by its checksum
+  uint8_t *tx = stm32_tx_acquire();
+  if(tx == nullptr)
   {
-    usb_transmit_msg("During stm32 config get command uart failed");
+    usb_transmit_log(log_id::READ_MEMORY_UART_BUSY);
     return false;
   }
-
-  if(stm32_read(&response, 1) != HAL_OK)
+  tx[0] = (uint8_t)(addr >> 24);
+  tx[1] = (uint8_t)(addr >> 16);
+  tx[2] = (uint8_t)(addr >> 8);
+  tx[3] = (uint8_t)addr;
+  tx[4] = tx[0] ^ tx[1] ^ tx[2] ^ tx[3];
+  stm32_tx_commit(5);
+
+  stm32_read(&response, 1, stm32_ack_timeout_us);
+  if(response != STM32_ACK)
   {
-      usb_transmit_msg("During stm32 config init read the uart error occured");
-      return false;
+    usb_transmit_log(log_id::READ_MEMORY_ADDR_NACK, addr, response);
+    return false;
   }
+  response = 0x0;
 
+  if(stm32_write(size, 2) != HAL_OK)
+  {
+    usb_transmit_log(log_id::READ_MEMORY_UART_BUSY);
+    return false;
+  }
+  stm32_read(&response, 1, stm32_ack_timeout_us);
   if(response != STM32_ACK)
   {
-      usb_transmit_msg("Stm32 config error. Waiting for ACK failed %d != %d", STM32_ACK, response);
-      return false;
+    usb_transmit_log(log_id::READ_MEMORY_SIZE_NACK, response);
+    return false;
   }
-  response = 0x0;
 
-  stm32_read(&response, 1);
-  if(response != 11)
+  return stm32_read(buf, count, stm32_ack_timeout_us) == HAL_OK;
+}
+
+// Calculates crc of the target memory reading it with Read Memory command
+static bool
+stm32_read_crc(uint32_t addr, uint32_t size, uint32_t &crc)
+{
+  uint8_t chunk[read_memory_max_size];
+  crc = crc32_init;
+
+  for(uint32_t offset = 0; offset < size; offset += read_memory_max_size)
   {
-    usb_transmit_msg("STM cmd length incorrect, 11 != %d", response);
-    return false;
+    const uint16_t count = size - offset < read_memory_max_size
+                           ? size - offset : read_memory_max_size;
+    if(!stm32_read_memory(addr + offset, chunk, count))
+      return false;
+    crc = crc32_update(crc, chunk, count);
   }
+  return true;
+}
+
+// Sends a 32 bit value MSB first followed by its checksum and waits for ACK
+static bool
+stm32_write_word(uint32_t value)
+{
+  uint8_t *tx = stm32_tx_acquire();
+  uint8_t response = 0x0;
+  if(tx == nullptr)
+    return false;
 
-  stm32_read(commands, cmds_res_size);
+  tx[0] = (uint8_t)(value >> 24);
+  tx[1] = (uint8_t)(value >> 16);
+  tx[2] = (uint8_t)(value >> 8);
+  tx[3] = (uint8_t)value;
+  tx[4] = tx[0] ^ tx[1] ^ tx[2] ^ tx[3];
+  stm32_tx_commit(5);
+
+  stm32_read(&response, 1, stm32_ack_timeout_us);
+  return response == STM32_ACK;
+}
 
-  stm_configuration.version = commands[0];
-  stm_configuration.get     = commands[1];
-  stm_configuration.gvr     = commands[2];
-  stm_configuration.gid     = commands[3];
-  stm_configuration.rm      = commands[4];
-  stm_configuration.go      = commands[5];
-  stm_configuration.wm      = commands[6];
-  stm_configuration.er      = commands[7];
-  stm_configuration.wp      = commands[8];
-  stm_configuration.uw      = commands[9];
-  stm_configuration.rp      = commands[10];
-  stm_configuration.ur      = commands[11];
+// Calculates crc of the target memory on the target by Get Checksum
+// command (AN3155), only the crc crosses the UART. The polynomial and
+// the initial value are the ones of crc.hpp
+static bool
+stm32_get_checksum(uint32_t addr, uint32_t size, uint32_t &crc)
+{
+  const uint8_t cmd[2] = {stm_configuration.ch, (uint8_t)(stm_configuration.ch^0xff)};
+  uint8_t answer[5];
+  uint8_t response=0x0;
 
-  if(stm_configuration.version == 0x33)
+  if(stm32_write(cmd, 2) != HAL_OK)
   {
-    stm32_read(&stm_configuration.ch, 1);
+    usb_transmit_log(log_id::CHECKSUM_UART_BUSY);
+    return false;
+  }
+  stm32_read(&response, 1, stm32_ack_timeout_us);
+  if(response != STM32_ACK)
+  {
+    usb_transmit_log(log_id::CHECKSUM_NACK, response);
+    return false;
   }
 
-  if(stm32_read(&response, 1) != HAL_OK)
+  // the area is given in words
+  if(!stm32_write_word(addr) || !stm32_write_word(size / 4) ||
+     !stm32_write_word(crc32_poly) || !stm32_write_word(crc32_init))
   {
-      return false;
+    usb_transmit_log(log_id::CHECKSUM_REJECTED, addr, size);
+    return false;
   }
 
-  if(response != STM32_ACK)
+  // ACK once the crc is calculated, then crc MSB first and its checksum
+  response = 0x0;
+  stm32_read(&response, 1, stm32_checksum_timeout_us);
+  if(response != STM32_ACK || stm32_read(answer, 5, stm32_ack_timeout_us) != HAL_OK ||
+     (answer[0] ^ answer[1] ^ answer[2] ^ answer[3]) != answer[4])
   {
-    usb_transmit_msg("Reading STM configuation commands failed");
+    usb_transmit_log(log_id::CHECKSUM_FAILED, addr);
     return false;
   }
 
-  usb_transmit_msg("STM configuation commands done");
+  crc = (uint32_t)answer[0] << 24 | (uint32_t)answer[1] << 16 | (uint32_t)answer[2] << 8 | answer[3];
   return true;
 }
 
-stm32_config
-get_config()
+// Calculates crc of the target memory, the checksum command of the
+// bootloader is used when it's available
+static bool
+stm32_memory_crc(uint32_t addr, uint32_t size, uint32_t &crc)
 {
-  return stm_configuration;
+  if(size == 0 || size % 4 != 0)
+  {
+    usb_transmit_log(log_id::CRC_RANGE_INCORRECT, addr, size);
+    return false;
+  }
+
+  if(stm_configuration.ch == STM32_CMD_GET_CHECKSUM)
+    return stm32_get_checksum(addr, size, crc);
+  return stm32_read_crc(addr, size, crc);
+}
+
+// Answer the state machine waits for, the longest one is the list of
+// commands of Get: version, up to 12 commands and ACK
+constexpr uint8_t stm32_answer_max_size = 14;
+struct stm32_answer_state
+{
+  uint32_t deadline;
+  uint8_t size;
+  uint8_t received;
+  uint8_t buf[stm32_answer_max_size];
+};
+static stm32_answer_state stm32_answer;
+
+// Expects size bytes of the answer to the last transfer, they must come
+// within timeout_us counted from its end. Missing bytes are left zero,
+// so a timeout looks like an unexpected answer
+static void
+stm32_expect(uint8_t size, uint32_t timeout_us)
+{
+  stm32_answer.deadline = stm32_time_us() + timeout_us +
+                          stm32_transfer_us(uart_tx_pending + size);
+  uart_tx_pending = 0;
+  stm32_answer.size = size;
+  stm32_answer.received = 0;
+  std::fill_n(stm32_answer.buf, size, 0);
 }
 
+// Collects the expected answer without waiting for it, true once it
+// is complete or its deadline has passed
 static bool
-stm32_erase_flash()
+stm32_answer_ready()
 {
-  constexpr uint8_t num_of_pages = 0xff;
-  const uint8_t er_cmd[2] = {stm_configuration.er, (uint8_t)(stm_configuration.er^0xff)};
-  const uint8_t er_all[2] = {num_of_pages, 0x00};
-  uint8_t response=0x0;
+  const uint16_t head = stm32_rx_head();
+  while(uart_rx_tail != head && stm32_answer.received < stm32_answer.size)
+  {
+    stm32_answer.buf[stm32_answer.received++] = uart_rx_dma_buf[uart_rx_tail];
+    uart_rx_tail = (uart_rx_tail + 1) % uart_rx_dma_size;
+  }
 
-  usb_transmit_msg("Erasing STM pages");
+  return stm32_answer.received == stm32_answer.size ||
+         static_cast<int32_t>(stm32_time_us() - stm32_answer.deadline) >= 0;
+}
 
-  stm32_write(er_cmd, 2);
-  stm32_read(&response, 1);
+static void flasher_finish(bool ok);
 
-  if(response != STM32_ACK)
-    return false;
-  response = 0x0;
+// Drives the boot pin and pulses reset, the target starts its bootloader
+// when boot is set and the flashed image otherwise
+static void
+pins_start(bool boot)
+{
+  HAL_GPIO_WritePin(GPIOC, Boot_Pin, boot ? GPIO_PIN_SET : GPIO_PIN_RESET);
+  pins_step = 0;
+  pins_deadline = stm32_time_us() + pin_hold_us;
+  state = flasher_state::PINS;
+}
 
-  stm32_write(er_all, 2);
-  stm32_read(&response, 1);
+// Logs why the flow failed and answers its command
+static void
+flasher_fail(log_id id)
+{
+  usb_transmit_log(id);
+  flasher_finish(false);
+}
 
-  if(response != STM32_ACK)
+static void
+stm32_sync_start()
+{
+  const uint8_t init_cmd = STM32_CMD_INIT;
+  if(stm32_write(&init_cmd, 1) != HAL_OK)
+  {
+    usb_transmit_log(log_id::CONFIG_WRITE_FAILED);
+    flasher_fail(log_id::INIT_FAILED);
+    return;
+  }
+  stm32_expect(1, stm32_ack_timeout_us);
+  state = flasher_state::SYNC;
+}
+
+static void
+pins_step_next()
+{
+  if(static_cast<int32_t>(stm32_time_us() - pins_deadline) < 0)
+    return;
+
+  pins_deadline += pin_hold_us;
+  switch(pins_step++)
+  {
+    case 0:
+      HAL_GPIO_WritePin(GPIOC, Reset_Pin, GPIO_PIN_RESET);
+      return;
+    case 1:
+      HAL_GPIO_WritePin(GPIOC, Reset_Pin, GPIO_PIN_SET);
+      return;
+  }
+
+  if(job == flasher_job::INIT)
+    stm32_sync_start();
+  else
+    flasher_finish(true);
+}
+
+// Checks the ACK which starts the answer to a configuration command
+static bool
+stm32_config_ack()
+{
+  if(stm32_answer.received == 0)
+  {
+    usb_transmit_log(log_id::CONFIG_READ_FAILED);
+    return false;
+  }
+  if(stm32_answer.buf[0] != STM32_ACK)
+  {
+    usb_transmit_log(log_id::CONFIG_ACK_FAILED, STM32_ACK, stm32_answer.buf[0]);
     return false;
+  }
+  return true;
+}
+
+static void
+stm32_erase_cmd_start()
+{
+  const uint8_t er_cmd[2] = {stm_configuration.er, (uint8_t)(stm_configuration.er^0xff)};
+  if(stm32_write(er_cmd, 2) != HAL_OK)
+  {
+    usb_transmit_log(log_id::ERASE_UART_BUSY);
+    flasher_fail(log_id::ERASE_FAILED);
+    return;
+  }
+  stm32_expect(1, stm32_ack_timeout_us);
+  state = flasher_state::ERASE_CMD;
+}
 
-  usb_transmit_msg("Erasing STM pages done");
+// Starts erasing count pages from first_page, for_job is answered once
+// they are done
+static bool
+stm32_erase_pages_start(flasher_job for_job, uint16_t first_page, uint16_t count)
+{
+  // standard erase addresses pages with a single byte
+  if(stm_configuration.er != STM32_CMD_EXT_ERASE && first_page + count > 0x100)
+  {
+    usb_transmit_log(log_id::ERASE_PAGE_RANGE_INCORRECT, first_page + count - 1);
+    return false;
+  }
 
+  usb_transmit_log(log_id::ERASE_PAGES_RANGE, first_page, first_page + count - 1);
+  job = for_job;
+  erase_all = false;
+  erase_next_page = first_page;
+  erase_pages_left = count;
+  stm32_erase_cmd_start();
   return true;
 }
 
-static  bool
-stm32_send_data(const addr_raw_t &addr, const uint8_t *payload, uint8_t size, uint8_t chksum)
+static void
+stm32_erase_flash_start(flasher_job for_job)
 {
-  const uint8_t cmd[2] = {stm_configuration.wm, (uint8_t)(stm_configuration.wm^0xff)};
-  const uint8_t addr_chksum =  addr[0] ^ addr[1] ^ addr[2] ^ addr[3];
-  uint8_t response=0x0;
+  usb_transmit_log(log_id::ERASE_PAGES);
+  job = for_job;
+  erase_all = true;
+  stm32_erase_cmd_start();
+}
 
-  //send command
-  stm32_write(cmd, 2);
-  stm32_read(&response, 1);
+// Sends the next batch of pages once Erase is ACKed
+static void
+stm32_erase_batch_send()
+{
+  if(erase_all)
+  {
+    // extended erase uses two byte page count, 0xffff means mass erase
+    const uint8_t er_all[2] = {0xff, 0x00};
+    const uint8_t ext_er_all[3] = {0xff, 0xff, 0x00};
+    const bool sent = stm_configuration.er == STM32_CMD_EXT_ERASE
+                      ? stm32_write(ext_er_all, sizeof(ext_er_all)) == HAL_OK
+                      : stm32_write(er_all, sizeof(er_all)) == HAL_OK;
+    if(!sent)
+    {
+      usb_transmit_log(log_id::ERASE_UART_BUSY);
+      flasher_fail(log_id::ERASE_FAILED);
+      return;
+    }
+    stm32_expect(1, stm32_mass_erase_timeout_us);
+    state = flasher_state::ERASE_ALL;
+    return;
+  }
 
-  if(response != STM32_ACK)
+  const bool extended = stm_configuration.er == STM32_CMD_EXT_ERASE;
+  uint8_t *tx = stm32_tx_acquire();
+  if(tx == nullptr)
   {
-    usb_transmit_msg("Sending payload command failed. ACK not received %x != 0x79", response);
-    return false;
+    usb_transmit_log(log_id::ERASE_UART_BUSY);
+    flasher_fail(log_id::ERASE_FAILED);
+    return;
+  }
+
+  // N-1, page numbers and checksum of all of them, MSB first
+  erase_batch = std::min(erase_pages_left, erase_pages_per_cmd);
+  uint32_t len = 0;
+  if(extended)
+    tx[len++] = (uint8_t)((erase_batch - 1) >> 8);
+  tx[len++] = (uint8_t)(erase_batch - 1);
+  for(uint16_t page = erase_next_page; page < erase_next_page + erase_batch; page++)
+  {
+    if(extended)
+      tx[len++] = (uint8_t)(page >> 8);
+    tx[len++] = (uint8_t)page;
   }
-  response = 0x0;
 
-  // send addr
-  stm32_write(addr.data(), addr.size());
-  // send addr checksum
-  stm32_write(&addr_chksum, 1);
+  uint8_t chksum = 0;
+  for(uint32_t i = 0; i < len; i++)
+    chksum ^= tx[i];
+  tx[len++] = chksum;
 
-  stm32_read(&response, 1);
-  if(response != STM32_ACK)
+  stm32_tx_commit(len);
+  stm32_expect(1, erase_batch * stm32_erase_page_timeout_us);
+  state = flasher_state::ERASE_PAGES;
+}
+
+// Starts the erase INIT asked for once the bootloader commands are known
+static void
+stm32_init_erase_start()
+{
+  // with NONE the pages are erased later on by PAGE_CHECK
+  if(init_erase_type == flash_erase_type::NONE)
+    flasher_finish(true);
+  else if(init_erase_type != flash_erase_type::PAGES)
+    stm32_erase_flash_start(flasher_job::INIT);
+  else if(!stm32_erase_pages_start(flasher_job::INIT, erase_next_page, erase_pages_left))
+    flasher_fail(log_id::ERASE_FAILED);
+}
+
+// Drops the rest of the staged data, the host learns about the failure
+// from the answer to its next command
+static void
+staging_write_failed()
+{
+  usb_transmit_log(log_id::BULK_WRITE_FAILED, write_seq, write_addr);
+  staging_failed = true;
+  state = flasher_state::IDLE;
+}
+
+// Starts the Write Memory command of the next staged chunk, returns false
+// when there is nothing to write or its data didn't come yet
+static bool
+staging_write_start()
+{
+  if(staging_failed)
   {
-    usb_transmit_msg("Sending payload address failed. ACK not received %x != 0x79", response);
+    // nothing is written until the next INIT
+    staged_blocks.reset();
+    staging_block_left = 0;
+    staging_tail = staging_head;
     return false;
   }
-  response = 0x0;
 
-  // we send N as a number of bytes to receive
-  // then N+1 bytes are send as stated in documentation
-  const uint8_t real_size = size-1;
-
-  // send payload size
-  if(stm32_write(&real_size, 1) != HAL_OK)
-    usb_transmit_msg("Sending realsize failed", response);
-  // send payload
-  if(stm32_write(payload, size)!= HAL_OK)
-    usb_transmit_msg("Sending payload failed", response);
-  // send addr checksum
-  if(stm32_write(&chksum, 1) != HAL_OK)
-    usb_transmit_msg("Sending chksum failed", response);
-
-  stm32_read(&response, 1);
-  if(response != STM32_ACK)
+  if(staging_block_left == 0)
   {
-    usb_transmit_msg("Sending payload frame failed. ACK not received %x != 0x79", response);
+    if(!staged_blocks.pop(&staging_block))
+      return false;
+    staging_block_left = staging_block.size;
+  }
+
+  const uint16_t chunk = std::min(write_memory_max_size, staging_block_left);
+  if(staging_head - staging_tail < chunk)
     return false;
+
+  write_chksum = (uint8_t)(chunk - 1);
+  for(uint16_t i = 0; i < chunk; i++)
+  {
+    write_buf[i] = staging[(staging_tail + i) % STAGING_SIZE];
+    write_chksum ^= write_buf[i];
   }
+  write_size = chunk;
+  write_addr = staging_block.addr;
+  write_seq = staging_block.seq;
+  staging_tail += chunk;
+  staging_block_left -= chunk;
+  staging_block.addr += chunk;
 
+  const uint8_t cmd[2] = {stm_configuration.wm, (uint8_t)(stm_configuration.wm^0xff)};
+  if(stm32_write(cmd, 2) != HAL_OK)
+  {
+    usb_transmit_log(log_id::WRITE_MEMORY_UART_BUSY);
+    staging_write_failed();
+    return true;
+  }
+  stm32_expect(1, stm32_ack_timeout_us);
+  state = flasher_state::WRITE_CMD;
   return true;
 }
 
 static void
-reset_hw_stm()
+stm32_write_addr_send()
 {
-  HAL_GPIO_WritePin(GPIOC, Reset_Pin, GPIO_PIN_RESET);
-  HAL_Delay(100);
-  HAL_GPIO_WritePin(GPIOC, Reset_Pin, GPIO_PIN_SET);
-  HAL_Delay(100);
+  uint8_t *tx = stm32_tx_acquire();
+  if(tx == nullptr)
+  {
+    usb_transmit_log(log_id::WRITE_MEMORY_UART_BUSY);
+    staging_write_failed();
+    return;
+  }
+
+  // address goes MSB first followed by its checksum
+  tx[0] = (uint8_t)(write_addr >> 24);
+  tx[1] = (uint8_t)(write_addr >> 16);
+  tx[2] = (uint8_t)(write_addr >> 8);
+  tx[3] = (uint8_t)write_addr;
+  tx[4] = tx[0] ^ tx[1] ^ tx[2] ^ tx[3];
+  stm32_tx_commit(5);
+  stm32_expect(1, stm32_ack_timeout_us);
+  state = flasher_state::WRITE_ADDR;
 }
 
 static void
-init_transfer()
+stm32_write_data_send()
 {
-  HAL_GPIO_WritePin(GPIOC, Boot_Pin, GPIO_PIN_SET);
-  HAL_Delay(100);
-  reset_hw_stm();
+  uint8_t *tx = stm32_tx_acquire();
+  if(tx == nullptr)
+  {
+    usb_transmit_log(log_id::WRITE_MEMORY_DATA_UART_BUSY);
+    staging_write_failed();
+    return;
+  }
+
+  // we send N as a number of bytes to receive, then N+1 bytes are
+  // sent as stated in documentation, all of it in one transfer
+  tx[0] = (uint8_t)(write_size - 1);
+  std::copy_n(write_buf, write_size, tx + 1);
+  tx[write_size + 1] = write_chksum;
+  if(stm32_tx_commit(write_size + 2) != HAL_OK)
+  {
+    usb_transmit_log(log_id::WRITE_MEMORY_DATA_FAILED);
+    staging_write_failed();
+    return;
+  }
+  stm32_expect(1, stm32_write_timeout_us);
+  state = flasher_state::WRITE_DATA;
 }
 
+// Moves the running flow on when what its state waits for is there
 static void
-reset_transfer()
+flasher_step()
 {
-  HAL_GPIO_WritePin(GPIOC, Boot_Pin, GPIO_PIN_RESET);
-  HAL_Delay(100);
-  reset_hw_stm();
+  if(state == flasher_state::IDLE)
+    return;
+
+  if(state == flasher_state::PINS)
+  {
+    pins_step_next();
+    return;
+  }
+
+  if(!stm32_answer_ready())
+    return;
+
+  const uint8_t *answer = stm32_answer.buf;
+  switch(state)
+  {
+    case flasher_state::SYNC:
+      if(!stm32_config_ack())
+      {
+        flasher_fail(log_id::INIT_FAILED);
+        return;
+      }
+      {
+        const uint8_t get_cmd[2] = {STM32_CMD_GET, STM32_CMD_GET^0xff};
+        if(stm32_write(get_cmd, 2) != HAL_OK)
+        {
+          usb_transmit_log(log_id::CONFIG_GET_FAILED);
+          flasher_fail(log_id::INIT_FAILED);
+          return;
+        }
+      }
+      // ACK and the number of commands
+      stm32_expect(2, stm32_ack_timeout_us);
+      state = flasher_state::GET;
+      break;
+    case flasher_state::GET:
+      if(!stm32_config_ack())
+      {
+        flasher_fail(log_id::INIT_FAILED);
+        return;
+      }
+      // bootloader 3.3 and later lists Get Checksum as the 12th command
+      if(answer[1] != 11 && answer[1] != 12)
+      {
+        usb_transmit_log(log_id::CONFIG_CMD_LENGTH, answer[1]);
+        flasher_fail(log_id::INIT_FAILED);
+        return;
+      }
+      // version, the commands and ACK
+      stm32_expect(answer[1] + 2, stm32_ack_timeout_us);
+      state = flasher_state::GET_COMMANDS;
+      break;
+    case flasher_state::GET_COMMANDS:
+      if(answer[stm32_answer.size - 1] != STM32_ACK)
+      {
+        usb_transmit_log(log_id::CONFIG_COMMANDS_FAILED);
+        flasher_fail(log_id::INIT_FAILED);
+        return;
+      }
+
+      stm_configuration.version = answer[0];
+      stm_configuration.get     = answer[1];
+      stm_configuration.gvr     = answer[2];
+      stm_configuration.gid     = answer[3];
+      stm_configuration.rm      = answer[4];
+      stm_configuration.go      = answer[5];
+      stm_configuration.wm      = answer[6];
+      stm_configuration.er      = answer[7];
+      stm_configuration.wp      = answer[8];
+      stm_configuration.uw      = answer[9];
+      stm_configuration.rp      = answer[10];
+      stm_configuration.ur      = answer[11];
+
+      stm_configuration.ch      = stm32_answer.size == 14 ? answer[12] : 0;
+
+      usb_transmit_log(log_id::CONFIG_COMMANDS_DONE);
+      stm32_init_erase_start();
+      break;
+    case flasher_state::ERASE_CMD:
+      if(answer[0] != STM32_ACK)
+      {
+        flasher_fail(log_id::ERASE_FAILED);
+        return;
+      }
+      stm32_erase_batch_send();
+      break;
+    case flasher_state::ERASE_PAGES:
+      if(answer[0] != STM32_ACK)
+      {
+        usb_transmit_log(log_id::ERASE_PAGE_NACK, erase_next_page, answer[0]);
+        flasher_fail(log_id::ERASE_FAILED);
+        return;
+      }
+
+      erase_next_page += erase_batch;
+      erase_pages_left -= erase_batch;
+      if(erase_pages_left > 0)
+      {
+        stm32_erase_cmd_start();
+        return;
+      }
+      usb_transmit_log(log_id::ERASE_PAGES_DONE);
+      flasher_finish(true);
+      break;
+    case flasher_state::ERASE_ALL:
+      if(answer[0] != STM32_ACK)
+      {
+        flasher_fail(log_id::ERASE_FAILED);
+        return;
+      }
+      usb_transmit_log(log_id::ERASE_PAGES_DONE);
+      flasher_finish(true);
+      break;
+    case flasher_state::WRITE_CMD:
+      if(answer[0] != STM32_ACK)
+      {
+        usb_transmit_log(log_id::WRITE_MEMORY_NACK, answer[0]);
+        staging_write_failed();
+        return;
+      }
+      stm32_write_addr_send();
+      break;
+    case flasher_state::WRITE_ADDR:
+      if(answer[0] != STM32_ACK)
+      {
+        usb_transmit_log(log_id::WRITE_MEMORY_ADDR_NACK, answer[0]);
+        staging_write_failed();
+        return;
+      }
+      stm32_write_data_send();
+      break;
+    case flasher_state::WRITE_DATA:
+      if(answer[0] != STM32_ACK)
+      {
+        usb_transmit_log(log_id::WRITE_MEMORY_DATA_NACK, answer[0]);
+        staging_write_failed();
+        return;
+      }
+      image_crc_update(write_buf, write_size);
+      state = flasher_state::IDLE;
+      break;
+    default:
+      break;
+  }
+}
+
+// Ends the flow and answers the command it was started for
+static void
+flasher_finish(bool ok)
+{
+  const flasher_job done = job;
+  state = flasher_state::IDLE;
+  job = flasher_job::NONE;
+
+  switch(done)
+  {
+    case flasher_job::INIT:
+      usb_transmit_cmd_response(ok ? flash_response_type::ACK : flash_response_type::NACK);
+      // the target runs its image again when INIT fails
+      if(!ok)
+        pins_start(false);
+      break;
+    case flasher_job::RESET:
+      {
+        usb_transmit_log(log_id::RESET_DONE);
+#if defined(WITH_SIMULATION)
+        uint8_t simulation_resest_cmd[2] = {0x3, 0xfc};
+        stm32_write(simulation_resest_cmd, 2);
+#endif
+        // the target is restarted even when a staged write failed, the
+        // host still learns that the image is incomplete
+        if(staging_failed)
+        {
+          usb_transmit_log(log_id::STAGED_WRITE_FAILED, (uint8_t)packet_type::RESET);
+          usb_transmit_cmd_response(flash_response_type::NACK);
+          break;
+        }
+        // crc of everything written lets the host confirm the whole image
+        usb_transmit_cmd_response(flash_response_type::ACK, 0, image_crc());
+      }
+      break;
+    case flasher_job::ERASE:
+      usb_transmit_cmd_response(ok ? flash_response_type::ACK : flash_response_type::NACK);
+      break;
+    case flasher_job::PAGE_CHECK:
+      usb_transmit_cmd_response(ok ? flash_response_type::PAGE_ERASED : flash_response_type::NACK);
+      break;
+    case flasher_job::NONE:
+      break;
+  }
+}
+
+// True when no flow runs and all of the staged data which came is written
+static bool
+flasher_drained()
+{
+  return state == flasher_state::IDLE && !staging_write_start();
+}
+
+// Compares the target page with the crc sent by the host, the page is
+// erased when it differs so it can be written again. PAGE_ERASED is
+// sent by the state machine once the erase is done, the function
+// returns it when the erase was started
+static flash_response_type
+stm32_check_page(const flash_page_check &page_check)
+{
+  const uint32_t addr = page_check.get_page_addr();
+  const uint32_t page_size = page_check.get_page_size();
+  uint32_t crc = crc32_init;
+
+  if(page_size == 0 || page_size % 4 != 0 || addr < STM32_FLASH_BASE ||
+     (addr - STM32_FLASH_BASE) % page_size != 0 ||
+     (addr - STM32_FLASH_BASE) / page_size > 0xffff)
+  {
+    usb_transmit_log(log_id::PAGE_INCORRECT, addr, page_size);
+    return flash_response_type::NACK;
+  }
+
+  if(!stm32_memory_crc(addr, page_size, crc))
+    return flash_response_type::NACK;
+
+  if(crc == page_check.get_crc())
+    return flash_response_type::PAGE_MATCH;
+
+  if(!stm32_erase_pages_start(flasher_job::PAGE_CHECK, (addr - STM32_FLASH_BASE) / page_size, 1))
+    return flash_response_type::NACK;
+
+  return flash_response_type::PAGE_ERASED;
 }
+
+static void
+staging_reset()
+{
+  staging_head = 0;
+  staging_tail = 0;
+  staged_blocks.reset();
+  staging_block_left = 0;
+  staging_failed = false;
+  bulk_write_active = false;
+}
+
+// Queues the block whose data follows, fails when the data of the previous
+// block didn't come in full
+static bool
+staging_begin(const staged_block &block)
+{
+  if(bulk_write_active)
+  {
+    usb_transmit_log(log_id::BULK_BLOCK_INCOMPLETE, bulk_write_seq, bulk_write_left);
+    bulk_write_active = false;
+    staging_failed = true;
+    return false;
+  }
+
+  staged_blocks.push_no_wait(block);
+  return true;
+}
+
+// True when a staged packet of the given type fits, FRAME, BULK_WRITE and
+// COMPRESSED_WRITE queue a block and FRAME and BULK_DATA bring its data.
+// The whole compressed block is given space up front, a few bytes of its
+// stream may decompress to much more
+static bool
+staging_room(packet_type type)
+{
+  const uint32_t free = STAGING_SIZE - (staging_head - staging_tail);
+  if(type != packet_type::BULK_DATA && staged_blocks.full())
+    return false;
+  if(type == packet_type::COMPRESSED_WRITE)
+    return free >= (uint32_t)flash_bulk_write_max_size;
+  return type == packet_type::BULK_WRITE || free >= (uint32_t)flash_bulk_data_max_length;
+}
+
+// Output of the decompressed blocks
+struct staging_sink
+{
+  void
+  put(uint8_t byte)
+  {
+    staging[staging_head % STAGING_SIZE] = byte;
+    staging_head++;
+  }
+
+  uint8_t
+  back(uint32_t distance) const
+  {
+    return staging[(staging_head - distance) % STAGING_SIZE];
+  }
+};
+
+// Appends the payload of a block to the staging buffer,
+// staging_room makes sure there is space for it
+static void
+staging_push(const uint8_t *data, uint8_t size)
+{
+  for(uint8_t i = 0; i < size; i++)
+    staging[(staging_head + i) % STAGING_SIZE] = data[i];
+  staging_head += size;
+}
+
 static void
 print_hw_config()
 {
   // show baudrate
-  usb_transmit_msg("Uart baudrate: %d", huartx.Init.BaudRate);
+  usb_transmit_log(log_id::UART_BAUDRATE, huartx.Init.BaudRate);
 
   // show stop_bits
   if(huartx.Init.StopBits == UART_STOPBITS_1)
-    usb_transmit_msg("Uart stopbits: 1 bit");
+    usb_transmit_log(log_id::UART_CFG_STOPBITS_1);
 #ifdef UART_STOPBITS_1_5
   else if(huartx.Init.StopBits == UART_STOPBITS_1_5)
-    usb_transmit_msg("Uart stopbits: 1.5 bit");
+    usb_transmit_log(log_id::UART_CFG_STOPBITS_1_5);
 #endif
   else if(huartx.Init.StopBits == UART_STOPBITS_2)
-    usb_transmit_msg("Uart stopbits: 2 bits");
+    usb_transmit_log(log_id::UART_CFG_STOPBITS_2);
   else
-    usb_transmit_msg("Uart stopbits: Unknown");
+    usb_transmit_log(log_id::UART_CFG_STOPBITS_UNKNOWN);
 
   // show word length
   if(huartx.Init.WordLength == UART_WORDLENGTH_8B)
-    usb_transmit_msg("Uart word length: 8 bits");
+    usb_transmit_log(log_id::UART_CFG_WORD_LENGTH_8);
   else if(huartx.Init.WordLength == UART_WORDLENGTH_9B)
-    usb_transmit_msg("Uart word length: 9 bits");
+    usb_transmit_log(log_id::UART_CFG_WORD_LENGTH_9);
   else
-    usb_transmit_msg("Uart word length: Unknown");
+    usb_transmit_log(log_id::UART_CFG_WORD_LENGTH_UNKNOWN);
 
   // show parity
   if(huartx.Init.Parity == UART_PARITY_NONE)
-    usb_transmit_msg("Uart parity: none");
+    usb_transmit_log(log_id::UART_CFG_PARITY_NONE);
   else if(huartx.Init.Parity== UART_PARITY_ODD)
-    usb_transmit_msg("Uart parity: odd");
+    usb_transmit_log(log_id::UART_CFG_PARITY_ODD);
   else if(huartx.Init.Parity== UART_PARITY_EVEN)
-    usb_transmit_msg("Uart parity: even");
+    usb_transmit_log(log_id::UART_CFG_PARITY_EVEN);
   else
-    usb_transmit_msg("Uart parity: Unknown");
+    usb_transmit_log(log_id::UART_CFG_PARITY_UNKNOWN);
 }
 
-void
+bool
 handle_command(uint8_t *data, uint32_t size)
 {
   raw_packet packet(data, size);
@@ -365,48 +1252,63 @@ handle_command(uint8_t *data, uint32_t size)
 
   if(!packet_type_opt.has_value())
   {
-      usb_transmit_msg("Incorrect frame type received");
+      usb_transmit_log(log_id::INCORRECT_FRAME_TYPE);
       usb_transmit_cmd_response(flash_response_type::NACK);
-      return;
+      return true;
   }
 
-  usb_transmit_msg("Handle command %d with size %d %d", (uint8_t)packet_type_opt.value(), data[0], size);
+  // staged packets wait for the answer to the running command and for
+  // space in the staging buffer, anything else waits until the running
+  // flow and the staged writes are done
+  const packet_type type = packet_type_opt.value();
+  const bool staged = type == packet_type::FRAME || type == packet_type::BULK_WRITE ||
+                      type == packet_type::BULK_DATA || type == packet_type::COMPRESSED_WRITE;
+  if(staged ? job != flasher_job::NONE || !staging_room(type) : !flasher_drained())
+    return false;
+
+  usb_transmit_log(log_id::HANDLE_COMMAND, (uint8_t)type, data[0], size);
+
+  if(!staged && type != packet_type::INIT && type != packet_type::RESET && staging_failed)
+  {
+    usb_transmit_log(log_id::STAGED_WRITE_FAILED, (uint8_t)type);
+    usb_transmit_cmd_response(flash_response_type::NACK);
+    return true;
+  }
 
   switch(packet_type_opt.value())
   {
       case packet_type::INIT:
         {
-          print_hw_config();
           auto flash_init_opt = flash_init::make_flash_init(packet);
-          usb_transmit_msg("Handle init packet");
           if(!flash_init_opt.has_value())
           {
-            usb_transmit_msg("Received init packet incorrect");
+            usb_transmit_log(log_id::INIT_INCORRECT);
             usb_transmit_cmd_response(flash_response_type::NACK);
-            return;
+            return true;
           }
 
           auto flash_init = flash_init_opt.value();
-          rx_queue.reset();
-          HAL_UART_Receive_IT(&huartx, &uart_rx_token, 1);
-          init_transfer();
+          log_verbosity = flash_init.get_verbosity();
+          staging_reset();
+          usb_transmit_log(log_id::HANDLE_INIT);
+          print_hw_config();
+          expected_frame_seq = 0;
+          image_crc_reset();
 
-          if(!stm32_init())
+          init_erase_type = flash_init.get_erase_type();
+          if(init_erase_type == flash_erase_type::PAGES &&
+             !image_pages(flash_init.get_image_addr(), flash_init.get_image_size(),
+                          flash_init.get_page_size(), erase_next_page, erase_pages_left))
           {
-            usb_transmit_msg("Init cmd failed");
+            usb_transmit_log(log_id::ERASE_FAILED);
             usb_transmit_cmd_response(flash_response_type::NACK);
-            reset_transfer();
-            return;
+            return true;
           }
 
-          if(!stm32_erase_flash())
-          {
-            usb_transmit_msg("Erase cmd failed");
-            usb_transmit_cmd_response(flash_response_type::NACK);
-            reset_transfer();
-            return;
-          }
-          usb_transmit_cmd_response(flash_response_type::ACK);
+          // answered once the bootloader is up and the erase is done
+          stm32_rx_start();
+          job = flasher_job::INIT;
+          pins_start(true);
         }
         break;
       case packet_type::FRAME:
@@ -414,22 +1316,177 @@ handle_command(uint8_t *data, uint32_t size)
           auto flash_frame_opt = flash_frame::make_flash_frame(packet);
           if(!flash_frame_opt.has_value())
           {
-            usb_transmit_msg("Received frame packet incorrect");
+            usb_transmit_log(log_id::FRAME_INCORRECT);
             usb_transmit_cmd_response(flash_response_type::NACK);
-            return;
+            return true;
           }
           auto flash_frame = flash_frame_opt.value();
-          auto flash_address = flash_frame.get_addr_raw();
-          if(!stm32_send_data(flash_address,
-                          flash_frame.get_payload(),
-                          flash_frame.get_payload_size(),
-                          flash_frame.get_checksum()))
+          const uint8_t seq = flash_frame.get_seq();
+          const uint8_t payload_size = flash_frame.get_payload_size();
+          if(payload_size == 0 ||
+             flash_frame.get_lenght() < (size_t)(flash_frame_payload_pos + payload_size))
+          {
+            usb_transmit_log(log_id::FRAME_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+          // frames are acknowledged cumulatively, so the host must never
+          // see an ACK for a frame which follows a lost one
+          if(seq != expected_frame_seq)
+          {
+            usb_transmit_log(log_id::FRAME_OUT_OF_ORDER, seq, expected_frame_seq);
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          // the staged frame is written with a checksum of its own, so the
+          // one the host sent is checked here
+          const uint8_t *payload = flash_frame.get_payload();
+          uint8_t chksum = (uint8_t)(payload_size - 1);
+          for(uint8_t i = 0; i < payload_size; i++)
+            chksum ^= payload[i];
+          if(chksum != flash_frame.get_checksum())
+          {
+            usb_transmit_log(log_id::FRAME_CHECKSUM_MISMATCH, seq, flash_frame.get_checksum(), chksum);
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          const addr_raw_t addr_raw = flash_frame.get_addr_raw();
+          const uint32_t addr = (uint32_t)addr_raw[0] << 24 | (uint32_t)addr_raw[1] << 16 |
+                                (uint32_t)addr_raw[2] << 8 | addr_raw[3];
+          if(!staging_begin({addr, payload_size, seq}))
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+          staging_push(payload, payload_size);
+          if(staging_failed)
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          expected_frame_seq++;
+          usb_transmit_cmd_response(flash_response_type::ACK, seq);
+        }
+        break;
+      case packet_type::BULK_WRITE:
+        {
+          auto flash_bulk_write_opt = flash_bulk_write::make_flash_bulk_write(packet);
+          if(!flash_bulk_write_opt.has_value())
+          {
+            usb_transmit_log(log_id::BULK_WRITE_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+          auto flash_bulk_write = flash_bulk_write_opt.value();
+          const uint8_t seq = flash_bulk_write.get_seq();
+          // blocks share the sequence numbers of the frames
+          if(seq != expected_frame_seq)
+          {
+            usb_transmit_log(log_id::FRAME_OUT_OF_ORDER, seq, expected_frame_seq);
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          const staged_block block = {flash_bulk_write.get_addr(),
+                                      flash_bulk_write.get_size(), seq};
+          if(!staging_begin(block))
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          bulk_write_active = true;
+          bulk_write_compressed = false;
+          bulk_write_seq = seq;
+          bulk_write_left = block.size;
+        }
+        break;
+      case packet_type::COMPRESSED_WRITE:
+        {
+          auto flash_compressed_write_opt = flash_compressed_write::make_flash_compressed_write(packet);
+          if(!flash_compressed_write_opt.has_value())
+          {
+            usb_transmit_log(log_id::COMPRESSED_WRITE_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+          auto flash_compressed_write = flash_compressed_write_opt.value();
+          const uint8_t seq = flash_compressed_write.get_seq();
+          if(seq != expected_frame_seq)
+          {
+            usb_transmit_log(log_id::FRAME_OUT_OF_ORDER, seq, expected_frame_seq);
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          const staged_block block = {flash_compressed_write.get_addr(),
+                                      flash_compressed_write.get_size(), seq};
+          if(!staging_begin(block))
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK, seq);
+            return true;
+          }
+
+          bulk_write_active = true;
+          bulk_write_compressed = true;
+          bulk_write_seq = seq;
+          bulk_write_left = flash_compressed_write.get_data_size();
+          bulk_write_decoder.reset(block.size);
+        }
+        break;
+      case packet_type::BULK_DATA:
+        {
+          auto flash_bulk_data_opt = flash_bulk_data::make_flash_bulk_data(packet);
+          if(!flash_bulk_data_opt.has_value())
           {
+            usb_transmit_log(log_id::BULK_DATA_INCORRECT);
             usb_transmit_cmd_response(flash_response_type::NACK);
-            return;
+            return true;
+          }
+          auto flash_bulk_data = flash_bulk_data_opt.value();
+          const uint8_t size = flash_bulk_data.get_data_size();
+          if(!bulk_write_active || size > bulk_write_left)
+          {
+            usb_transmit_log(log_id::BULK_DATA_OUT_OF_BLOCK, size,
+                             bulk_write_active ? bulk_write_left : 0);
+            usb_transmit_cmd_response(flash_response_type::NACK, bulk_write_seq);
+            // the staged block will never be complete
+            if(bulk_write_active)
+              staging_failed = true;
+            bulk_write_active = false;
+            return true;
           }
 
-          usb_transmit_cmd_response(flash_response_type::ACK);
+          bulk_write_left -= size;
+          if(!bulk_write_compressed)
+            staging_push(flash_bulk_data.get_data(), size);
+          else if(!staging_failed)
+          {
+            staging_sink sink;
+            // a stream which ends early would leave the block short
+            if(!bulk_write_decoder.feed(flash_bulk_data.get_data(), size, sink) ||
+               (bulk_write_left == 0 && !bulk_write_decoder.done()))
+            {
+              usb_transmit_log(log_id::COMPRESSED_DATA_CORRUPT, bulk_write_seq);
+              staging_failed = true;
+            }
+          }
+          if(bulk_write_left != 0)
+            return true;
+
+          // the whole block is answered with a single status as soon as it
+          // is staged, a write which fails later on NACKs the next command
+          bulk_write_active = false;
+          if(staging_failed)
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK, bulk_write_seq);
+            return true;
+          }
+          expected_frame_seq++;
+          usb_transmit_cmd_response(flash_response_type::ACK, bulk_write_seq);
         }
         break;
       case packet_type::RESET:
@@ -437,22 +1494,87 @@ handle_command(uint8_t *data, uint32_t size)
           auto flash_init_opt = flash_reset::make_flash_reset(packet);
           if(!flash_init_opt.has_value())
           {
-            usb_transmit_msg("Received reset packet incorrect");
+            usb_transmit_log(log_id::RESET_INCORRECT);
             usb_transmit_cmd_response(flash_response_type::NACK);
-            return;
+            return true;
           }
 
-          reset_transfer();
-          usb_transmit_msg("Reset done");
-#if defined(WITH_SIMULATION)
-          uint8_t simulation_resest_cmd[2] = {0x3, 0xfc};
-          stm32_write(simulation_resest_cmd, 2);
-#endif
-          usb_transmit_cmd_response(flash_response_type::ACK);
+          // answered once the target is restarted
+          job = flasher_job::RESET;
+          pins_start(false);
+        }
+        break;
+      case packet_type::PAGE_CHECK:
+        {
+          auto flash_page_check_opt = flash_page_check::make_flash_page_check(packet);
+          if(!flash_page_check_opt.has_value())
+          {
+            usb_transmit_log(log_id::PAGE_CHECK_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+
+          const flash_response_type response = stm32_check_page(flash_page_check_opt.value());
+          if(response != flash_response_type::PAGE_ERASED)
+            usb_transmit_cmd_response(response);
+        }
+        break;
+      case packet_type::VERIFY:
+        {
+          auto flash_verify_opt = flash_verify::make_flash_verify(packet);
+          if(!flash_verify_opt.has_value())
+          {
+            usb_transmit_log(log_id::VERIFY_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+
+          auto flash_verify = flash_verify_opt.value();
+          uint32_t crc = crc32_init;
+          if(!stm32_memory_crc(flash_verify.get_addr(), flash_verify.get_size(), crc))
+          {
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+          usb_transmit_cmd_response(flash_response_type::ACK, 0, crc);
+        }
+        break;
+      case packet_type::ERASE:
+        {
+          auto flash_erase_opt = flash_erase::make_flash_erase(packet);
+          if(!flash_erase_opt.has_value())
+          {
+            usb_transmit_log(log_id::ERASE_INCORRECT);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+            return true;
+          }
+
+          auto flash_erase = flash_erase_opt.value();
+          uint16_t first_page = 0;
+          uint16_t count = 0;
+          // answered once the pages are erased
+          if(!image_pages(flash_erase.get_addr(), flash_erase.get_size(), flash_erase.get_page_size(),
+                          first_page, count) ||
+             !stm32_erase_pages_start(flasher_job::ERASE, first_page, count))
+          {
+            usb_transmit_log(log_id::ERASE_FAILED);
+            usb_transmit_cmd_response(flash_response_type::NACK);
+          }
         }
         break;
       default:
-            usb_transmit_msg("Handler failed");
+            usb_transmit_log(log_id::HANDLER_FAILED);
         break;
   }
+  return true;
+}
+
+// Moves the running flow on and writes the staged data while the host is
+// sending more of it, called from the main loop between the USB packets
+void
+flasher_poll(void)
+{
+  flasher_step();
+  if(state == flasher_state::IDLE)
+    staging_write_start();
 }
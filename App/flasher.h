@@ -1,10 +1,14 @@
 #pragma once
 #include<stdint.h>
+#include<stdbool.h>
 
 #define STM32_ACK	0x79
 #define STM32_NACK 0x1F
 #define STM32_CMD_INIT 0x7F
 #define STM32_CMD_GET	0x00
+#define STM32_CMD_EXT_ERASE 0x44
+#define STM32_CMD_GET_CHECKSUM 0xA1
+#define STM32_FLASH_BASE 0x08000000
 
 typedef struct  {
         uint32_t bl_version;
@@ -23,6 +27,6 @@ typedef struct  {
         uint8_t ch; // ony with firmware > 3.3
 }stm32_config;
 
-void handle_command(uint8_t *data, uint32_t size);
-void usb_transmit_msg(const char *format, ...);
+bool handle_command(uint8_t *data, uint32_t size);
+void flasher_poll(void);
 stm32_config get_config();
@@ -42,6 +42,13 @@ struct ring_buffer{
     return head == tail;
   }
 
+  bool full()
+  {
+    int head_next = head;
+    MODULO_INC(head_next, S);
+    return head_next == tail;
+  }
+
   void
   reset()
   {
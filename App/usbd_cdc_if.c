@@ -33,10 +33,19 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 extern USBD_HandleTypeDef hUsbDeviceFS;
 
+/* Part of the last USB packet which is not assembled yet */
+static uint8_t *rx_pending;
+static uint32_t rx_pending_len;
+/* Set when the OUT endpoint is prepared to receive */
+static uint8_t rx_armed;
+
 static int8_t CDC_Init_FS(void);
 static int8_t CDC_DeInit_FS(void);
 static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length);
 static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
+static int8_t CDC_TransmitCplt_FS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
+static void CDC_Assemble_Rx_FS(void);
+static void CDC_Transmit_Queue_FS(void);
 
 uint32_t cdc_parity_to_hal_parity(uint8_t parity)
 {
@@ -97,7 +106,8 @@ USBD_CDC_ItfTypeDef USBD_Interface_fops_FS =
   CDC_Init_FS,
   CDC_DeInit_FS,
   CDC_Control_FS,
-  CDC_Receive_FS
+  CDC_Receive_FS,
+  CDC_TransmitCplt_FS
 };
 
 static int8_t CDC_Init_FS(void)
@@ -111,6 +121,11 @@ static int8_t CDC_Init_FS(void)
 
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, 0);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  usb_rx_reset();
+  usb_tx_reset();
+  rx_pending_len = 0;
+  // the class driver prepares the OUT endpoint right after this call
+  rx_armed = 1;
   uart_init(&uart_line_config);
   return (USBD_OK);
 }
@@ -238,13 +253,13 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-  if(usb_event_rx == 1)
-    return USBD_BUSY;
-  memcpy(usb_rx.buf, Buf, *Len);
-  usb_rx.len = *Len;
-  usb_event_rx = 1;
+  rx_armed = 0;
+  rx_pending = Buf;
+  rx_pending_len = *Len;
 
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  // the endpoint is re-armed once the whole USB packet is assembled,
+  // until then the host is NAKed instead of losing data
+  CDC_Assemble_Rx_FS();
 
   return (USBD_OK);
   /* USER CODE END 6 */
@@ -275,3 +290,101 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
   /* USER CODE END 7 */
   return result;
 }
+
+/**
+  * @brief  CDC_TransmitCplt_FS
+  *         Called when the IN transfer is complete, continues
+  *         with the data queued in the meantime.
+  * @param  Buf: Buffer of the sent data
+  * @param  Len: Number of sent data (in bytes)
+  * @param  epnum: Endpoint number
+  * @retval USBD_OK
+  */
+static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
+{
+  CDC_Transmit_Queue_FS();
+  return (USBD_OK);
+}
+
+/**
+  * @brief  CDC_Send_FS
+  *         Queues a packet and starts sending it when the IN
+  *         endpoint is idle, never waits for the endpoint.
+  * @param  Buf: Packet to send
+  * @param  Len: Packet length
+  * @param  reserve: Queue space which has to stay free for other packets
+  * @retval USBD_OK when queued, USBD_BUSY when the queue is full
+  *         and the packet was dropped
+  */
+uint8_t CDC_Send_FS(const uint8_t* Buf, uint16_t Len, uint16_t reserve)
+{
+  if(!usb_tx_push(Buf, Len, reserve))
+    return USBD_BUSY;
+
+  // the transfer complete interrupt takes from the queue as well
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  CDC_Transmit_Queue_FS();
+  __set_PRIMASK(primask);
+  return USBD_OK;
+}
+
+/**
+  * @brief  CDC_Release_Rx_FS
+  *         Frees the slot of the handled packet and continues
+  *         with the data waiting for it.
+  * @retval None
+  */
+void CDC_Release_Rx_FS(void)
+{
+  usb_rx_pop();
+  CDC_Assemble_Rx_FS();
+}
+
+/**
+  * @brief  CDC_Assemble_Rx_FS
+  *         Moves the pending USB data into the receive slots while
+  *         there is a free one. The OUT endpoint is prepared again
+  *         only when all of the received data were consumed and
+  *         a slot is available, otherwise the host is NAKed.
+  * @retval None
+  */
+static void CDC_Assemble_Rx_FS(void)
+{
+  while(rx_pending_len != 0 && usb_rx_slot_free())
+  {
+    uint32_t consumed = usb_rx_assemble(rx_pending, rx_pending_len);
+    rx_pending += consumed;
+    rx_pending_len -= consumed;
+  }
+
+  if(rx_pending_len == 0 && !rx_armed && usb_rx_slot_free())
+  {
+    rx_armed = 1;
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  }
+}
+
+/**
+  * @brief  CDC_Transmit_Queue_FS
+  *         Sends as much of the queued data as fits into one IN
+  *         transfer, so packets queued while the endpoint was busy
+  *         share a transfer. Nothing is done while a transfer is
+  *         in progress, its completion calls this again.
+  * @retval None
+  */
+static void CDC_Transmit_Queue_FS(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if (hcdc == NULL || hcdc->TxState != 0){
+    return;
+  }
+
+  uint32_t len = usb_tx_take(UserTxBufferFS, CDC_DATA_FS_IN_PACKET_SIZE);
+  if (len == 0){
+    return;
+  }
+
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, len);
+  USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+}
@@ -30,6 +30,8 @@
 #include <string.h>
 
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+uint8_t CDC_Send_FS(const uint8_t* Buf, uint16_t Len, uint16_t reserve);
+void CDC_Release_Rx_FS(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32/MPEG-2 calculated over little endian 32 bit words, this is what
+// the STM32 CRC unit in its reset configuration gives for CRC->DR = word
+constexpr uint32_t crc32_poly = 0x04C11DB7;
+constexpr uint32_t crc32_init = 0xFFFFFFFF;
+
+constexpr uint32_t
+crc32_word(uint32_t crc, const uint32_t word) noexcept
+{
+  crc ^= word;
+  for (int bit = 0; bit < 32; bit++)
+    crc = (crc & 0x80000000) ? (crc << 1) ^ crc32_poly : crc << 1;
+  return crc;
+}
+
+// size must divide by 4, the remaining bytes are ignored
+inline uint32_t
+crc32_update(uint32_t crc, const uint8_t* data, const size_t size) noexcept
+{
+  for (size_t i = 0; i + 4 <= size; i += 4)
+  {
+    const uint32_t word = static_cast<uint32_t>(data[i]) |
+                          static_cast<uint32_t>(data[i + 1]) << 8 |
+                          static_cast<uint32_t>(data[i + 2]) << 16 |
+                          static_cast<uint32_t>(data[i + 3]) << 24;
+    crc = crc32_word(crc, word);
+  }
+  return crc;
+}
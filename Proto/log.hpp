@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+
+// Messages of the bridge. The bridge sends only the id with the raw
+// arguments in a LOG packet, the host formats them with the text given
+// here as printf would. Only integer conversions (%d %u %x %c) may be
+// used. The ids are part of the protocol, new messages are appended.
+// The level decides whether the message is sent at the verbosity
+// requested by the host in INIT.
+#define FLASH_LOG_MESSAGES(X) \
+  X(INCORRECT_FRAME_TYPE,         ERROR, "Incorrect frame type received")                               \
+  X(HANDLE_COMMAND,               TRACE, "Handle command %d with size %d %d")                           \
+  X(HANDLER_FAILED,               ERROR, "Handler failed")                                              \
+  X(HANDLE_INIT,                  TRACE, "Handle init packet")                                          \
+  X(INIT_INCORRECT,               ERROR, "Received init packet incorrect")                              \
+  X(INIT_FAILED,                  ERROR, "Init cmd failed")                                             \
+  X(ERASE_FAILED,                 ERROR, "Erase cmd failed")                                            \
+  X(FRAME_INCORRECT,              ERROR, "Received frame packet incorrect")                             \
+  X(FRAME_OUT_OF_ORDER,           ERROR, "Frame out of order %d != %d")                                 \
+  X(RESET_INCORRECT,              ERROR, "Received reset packet incorrect")                             \
+  X(RESET_DONE,                   INFO,  "Reset done")                                                  \
+  X(PAGE_CHECK_INCORRECT,         ERROR, "Received page check packet incorrect")                        \
+  X(ERASE_INCORRECT,              ERROR, "Received erase packet incorrect")                             \
+  X(VERIFY_INCORRECT,             ERROR, "Received verify packet incorrect")                            \
+  X(RESPONSE_FAILED,              ERROR, "Sending response failed")                                     \
+  X(UART_BAUDRATE,                INFO,  "Uart baudrate: %d")                                           \
+  X(UART_CFG_STOPBITS_1,          INFO,  "Uart stopbits: 1 bit")                                        \
+  X(UART_CFG_STOPBITS_1_5,        INFO,  "Uart stopbits: 1.5 bit")                                      \
+  X(UART_CFG_STOPBITS_2,          INFO,  "Uart stopbits: 2 bits")                                       \
+  X(UART_CFG_STOPBITS_UNKNOWN,    INFO,  "Uart stopbits: Unknown")                                      \
+  X(UART_CFG_WORD_LENGTH_8,       INFO,  "Uart word length: 8 bits")                                    \
+  X(UART_CFG_WORD_LENGTH_9,       INFO,  "Uart word length: 9 bits")                                    \
+  X(UART_CFG_WORD_LENGTH_UNKNOWN, INFO,  "Uart word length: Unknown")                                   \
+  X(UART_CFG_PARITY_NONE,         INFO,  "Uart parity: none")                                           \
+  X(UART_CFG_PARITY_ODD,          INFO,  "Uart parity: odd")                                            \
+  X(UART_CFG_PARITY_EVEN,         INFO,  "Uart parity: even")                                           \
+  X(UART_CFG_PARITY_UNKNOWN,      INFO,  "Uart parity: Unknown")                                        \
+  X(CONFIG_WRITE_FAILED,          ERROR, "During stm32 config init write the uart error occured")       \
+  X(CONFIG_READ_FAILED,           ERROR, "During stm32 config init read the uart error occured")        \
+  X(CONFIG_GET_FAILED,            ERROR, "During stm32 config get command uart failed")                 \
+  X(CONFIG_ACK_FAILED,            ERROR, "Stm32 config error. Waiting for ACK failed %d != %d")         \
+  X(CONFIG_CMD_LENGTH,            ERROR, "STM cmd count %d, expected 11 or 12")                         \
+  X(CONFIG_COMMANDS_FAILED,       ERROR, "Reading STM configuation commands failed")                    \
+  X(CONFIG_COMMANDS_DONE,         INFO,  "STM configuation commands done")                              \
+  X(ERASE_PAGES,                  INFO,  "Erasing STM pages")                                           \
+  X(ERASE_PAGES_RANGE,            INFO,  "Erasing STM pages %d-%d")                                     \
+  X(ERASE_PAGE_RANGE_INCORRECT,   ERROR, "Page %d out of erase command range")                          \
+  X(ERASE_UART_BUSY,              ERROR, "Erasing pages failed. UART busy")                             \
+  X(ERASE_PAGE_NACK,              ERROR, "Erasing page %d failed. ACK not received %x != 0x79")         \
+  X(ERASE_PAGES_DONE,             INFO,  "Erasing STM pages done")                                      \
+  X(IMAGE_RANGE_INCORRECT,        ERROR, "Incorrect image range %x %d, page size %d")                   \
+  X(IMAGE_EXCEEDS_FLASH,          ERROR, "Image exceeds the flash, last page %d")                       \
+  X(READ_MEMORY_NACK,             ERROR, "Read memory command failed. ACK not received %x != 0x79")     \
+  X(READ_MEMORY_UART_BUSY,        ERROR, "Read memory failed. UART busy")                               \
+  X(READ_MEMORY_ADDR_NACK,        ERROR, "Read memory address %x failed. ACK not received %x != 0x79")  \
+  X(READ_MEMORY_SIZE_NACK,        ERROR, "Read memory size failed. ACK not received %x != 0x79")        \
+  X(CHECKSUM_NACK,                ERROR, "Get checksum command failed. ACK not received %x != 0x79")    \
+  X(CHECKSUM_REJECTED,            ERROR, "Get checksum of %x size %d rejected")                         \
+  X(CHECKSUM_FAILED,              ERROR, "Get checksum of %x failed")                                   \
+  X(CRC_RANGE_INCORRECT,          ERROR, "Incorrect crc range %x of size %d")                           \
+  X(PAGE_INCORRECT,               ERROR, "Incorrect page %x of size %d")                                \
+  X(WRITE_MEMORY_NACK,            ERROR, "Sending payload command failed. ACK not received %x != 0x79") \
+  X(WRITE_MEMORY_UART_BUSY,       ERROR, "Sending payload address failed. UART busy")                   \
+  X(WRITE_MEMORY_ADDR_NACK,       ERROR, "Sending payload address failed. ACK not received %x != 0x79") \
+  X(WRITE_MEMORY_DATA_UART_BUSY,  ERROR, "Sending payload failed. UART busy")                           \
+  X(WRITE_MEMORY_DATA_FAILED,     ERROR, "Sending payload failed")                                      \
+  X(WRITE_MEMORY_DATA_NACK,       ERROR, "Sending payload frame failed. ACK not received %x != 0x79")   \
+  X(BULK_WRITE_INCORRECT,         ERROR, "Received bulk write packet incorrect")                        \
+  X(BULK_DATA_INCORRECT,          ERROR, "Received bulk data packet incorrect")                         \
+  X(BULK_DATA_OUT_OF_BLOCK,       ERROR, "Bulk data of %d bytes out of block, %d bytes left")           \
+  X(BULK_WRITE_FAILED,            ERROR, "Bulk write of block %d failed at %x")                         \
+  X(BULK_BLOCK_INCOMPLETE,        ERROR, "Block %d incomplete, %d bytes missing")                       \
+  X(STAGED_WRITE_FAILED,          ERROR, "Staged blocks not written, command %d rejected")              \
+  X(FRAME_CHECKSUM_MISMATCH,      ERROR, "Frame %d checksum %x != %x")                                  \
+  X(COMPRESSED_WRITE_INCORRECT,   ERROR, "Received compressed write packet incorrect")                  \
+  X(COMPRESSED_DATA_CORRUPT,      ERROR, "Compressed block %d corrupt")                                 \
+  X(CHECKSUM_UART_BUSY,           ERROR, "Get checksum failed. UART busy")
+
+enum class log_id : uint8_t
+{
+#define FLASH_LOG_ID(id, level, text) id,
+  FLASH_LOG_MESSAGES(FLASH_LOG_ID)
+#undef FLASH_LOG_ID
+  COUNT
+};
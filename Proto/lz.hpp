@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// Byte oriented LZ77 used for COMPRESSED_WRITE blocks. The stream is a
+// sequence of tokens:
+//   0x00-0x7f  literals, token + 1 bytes follow as they are
+//   0x80-0xff  match of (token & 0x7f) + lz_min_match bytes, followed by
+//              the distance - 1 as 16 bit little endian
+// A match may overlap the bytes it produces, so a run of one byte is a
+// literal and a match at distance 1. Matches reach at most lz_window_size
+// bytes back, the decoder needs no memory of its own besides that window.
+constexpr size_t lz_window_size = 4096;
+constexpr size_t lz_min_match   = 4;
+constexpr size_t lz_max_match   = 0x7f + lz_min_match;
+constexpr size_t lz_max_literal = 0x80;
+
+constexpr uint8_t lz_match_flag = 0x80;
+
+// Compresses size bytes of src into dst, nullopt when the result doesn't
+// fit into capacity. Meant for the host, the hash table lives on the stack
+inline std::optional<size_t>
+lz_compress(const uint8_t *src, const size_t size, uint8_t *dst, const size_t capacity) noexcept
+{
+  constexpr size_t hash_bits = 12;
+  constexpr uint32_t no_pos = UINT32_MAX;
+  std::array<uint32_t, 1 << hash_bits> last_pos;
+  last_pos.fill(no_pos);
+
+  auto hash = [src](size_t pos) {
+    const uint32_t v = static_cast<uint32_t>(src[pos]) | static_cast<uint32_t>(src[pos + 1]) << 8 |
+                       static_cast<uint32_t>(src[pos + 2]) << 16 | static_cast<uint32_t>(src[pos + 3]) << 24;
+    return (v * 2654435761u) >> (32 - hash_bits);
+  };
+
+  size_t out = 0;
+  size_t literal_start = 0;
+  auto flush_literals = [&](size_t end) {
+    while (literal_start < end)
+    {
+      const size_t count = std::min(end - literal_start, lz_max_literal);
+      if (out + 1 + count > capacity)
+        return false;
+      dst[out++] = static_cast<uint8_t>(count - 1);
+      for (size_t i = 0; i < count; i++)
+        dst[out++] = src[literal_start + i];
+      literal_start += count;
+    }
+    return true;
+  };
+
+  size_t pos = 0;
+  while (pos + lz_min_match <= size)
+  {
+    const uint32_t h = hash(pos);
+    const uint32_t candidate = last_pos[h];
+    last_pos[h] = static_cast<uint32_t>(pos);
+
+    size_t length = 0;
+    if (candidate != no_pos && pos - candidate <= lz_window_size)
+    {
+      const size_t limit = std::min(size - pos, lz_max_match);
+      while (length < limit && src[candidate + length] == src[pos + length])
+        length++;
+    }
+
+    if (length < lz_min_match)
+    {
+      pos++;
+      continue;
+    }
+
+    if (!flush_literals(pos) || out + 3 > capacity)
+      return std::nullopt;
+
+    const size_t distance = pos - candidate - 1;
+    dst[out++] = static_cast<uint8_t>(lz_match_flag | (length - lz_min_match));
+    dst[out++] = static_cast<uint8_t>(distance);
+    dst[out++] = static_cast<uint8_t>(distance >> 8);
+
+    // the skipped positions are matched later on as well
+    for (size_t i = 1; i < length && pos + i + lz_min_match <= size; i++)
+      last_pos[hash(pos + i)] = static_cast<uint32_t>(pos + i);
+    pos += length;
+    literal_start = pos;
+  }
+
+  if (!flush_literals(size))
+    return std::nullopt;
+  return out;
+}
+
+// Streaming decoder, the stream may be fed in parts of any size. The
+// output goes to a sink which has put(uint8_t) and back(distance)
+// returning the byte put distance bytes ago, it has to keep
+// lz_window_size of them
+class lz_decoder
+{
+public:
+  // size is the number of bytes the stream decodes to
+  void
+  reset(const uint32_t size) noexcept
+  {
+    _state = state::TOKEN;
+    _size = size;
+    _produced = 0;
+    _count = 0;
+  }
+
+  bool
+  done() const noexcept
+  {
+    return _produced == _size;
+  }
+
+  // false when the stream is corrupt: it decodes to more than size bytes
+  // or a match reaches before the first byte. Bytes which follow the end
+  // of the stream are padding and are ignored
+  template<typename Sink>
+  bool
+  feed(const uint8_t *data, const size_t count, Sink &sink) noexcept
+  {
+    for (size_t i = 0; i < count && !done(); i++)
+    {
+      const uint8_t byte = data[i];
+      switch (_state)
+      {
+        case state::TOKEN:
+          if (byte & lz_match_flag)
+          {
+            _count = (byte & ~lz_match_flag) + lz_min_match;
+            _state = state::DISTANCE_LOW;
+          }
+          else
+          {
+            _count = byte + 1;
+            _state = state::LITERALS;
+          }
+          if (_size - _produced < _count)
+            return false;
+          break;
+        case state::LITERALS:
+          sink.put(byte);
+          _produced++;
+          if (--_count == 0)
+            _state = state::TOKEN;
+          break;
+        case state::DISTANCE_LOW:
+          _distance = byte;
+          _state = state::DISTANCE_HIGH;
+          break;
+        case state::DISTANCE_HIGH:
+          _distance |= static_cast<uint32_t>(byte) << 8;
+          _distance++;
+          if (_distance > _produced || _distance > lz_window_size)
+            return false;
+          for (; _count > 0; _count--, _produced++)
+            sink.put(sink.back(_distance));
+          _state = state::TOKEN;
+          break;
+      }
+    }
+    return true;
+  }
+
+private:
+  enum class state : uint8_t
+  {
+    TOKEN,
+    LITERALS,
+    DISTANCE_LOW,
+    DISTANCE_HIGH
+  };
+
+  state _state = state::TOKEN;
+  uint32_t _size = 0;
+  uint32_t _produced = 0;
+  uint32_t _count = 0; // literals or match bytes left
+  uint32_t _distance = 0;
+};
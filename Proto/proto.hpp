@@ -69,6 +69,13 @@ public:
       case packet_type::RESET:
       case packet_type::RESPONSE:
       case packet_type::MSG:
+      case packet_type::PAGE_CHECK:
+      case packet_type::ERASE:
+      case packet_type::VERIFY:
+      case packet_type::LOG:
+      case packet_type::BULK_WRITE:
+      case packet_type::BULK_DATA:
+      case packet_type::COMPRESSED_WRITE:
         return static_cast<packet_type>(_packet[common_type_pos]);
       default:
         return std::nullopt;
@@ -100,10 +107,52 @@ public:
     packet.data()[common_length_pos] = usb_byte_t{ flash_init_length };
     packet.data()[common_type_pos] =
       usb_byte_t{ static_cast<uint8_t>(packet_type::INIT) };
+    packet.data()[flash_init_erase_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(flash_erase_type::MASS) };
+
+    std::fill_n(packet.begin() + flash_init_addr_pos,
+                flash_init_addr_size + flash_init_image_size_size + flash_init_page_size_size,
+                usb_byte_t{ 0 });
+    packet.data()[flash_init_verbosity_pos] =
+      usb_byte_t{ static_cast<uint8_t>(flash_log_level::ERROR) };
 
     return flash_init_builder(packet);
   }
 
+  void
+  set_erase_type(const flash_erase_type type) noexcept
+  {
+    this->_raw_packet.data()[flash_init_erase_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(type) };
+  }
+
+  // address and size of the image which is going to be flashed
+  void
+  set_image_range(const uint32_t addr, const uint32_t size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_init_addr_size,
+                this->_raw_packet.begin() + flash_init_addr_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&size),
+                flash_init_image_size_size,
+                this->_raw_packet.begin() + flash_init_image_size_pos);
+  }
+
+  void
+  set_page_size(const uint16_t page_size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&page_size),
+                flash_init_page_size_size,
+                this->_raw_packet.begin() + flash_init_page_size_pos);
+  }
+
+  void
+  set_verbosity(const flash_log_level level) noexcept
+  {
+    this->_raw_packet.data()[flash_init_verbosity_pos] =
+      usb_byte_t{ static_cast<uint8_t>(level) };
+  }
+
 private:
   explicit flash_init_builder(raw_packet packet) noexcept
     : _raw_packet(packet)
@@ -134,6 +183,48 @@ public:
     return flash_init_length;
   }
 
+  flash_erase_type
+  get_erase_type() const noexcept
+  {
+    return static_cast<flash_erase_type>(this->cdata()[flash_init_erase_type_pos]);
+  }
+
+  uint32_t
+  get_image_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_init_addr_pos,
+                flash_init_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint32_t
+  get_image_size() const noexcept
+  {
+    uint32_t size = 0;
+    std::copy_n(this->cdata() + flash_init_image_size_pos,
+                flash_init_image_size_size,
+                reinterpret_cast<usb_byte_t*>(&size));
+    return size;
+  }
+
+  uint16_t
+  get_page_size() const noexcept
+  {
+    uint16_t page_size = 0;
+    std::copy_n(this->cdata() + flash_init_page_size_pos,
+                flash_init_page_size_size,
+                reinterpret_cast<usb_byte_t*>(&page_size));
+    return page_size;
+  }
+
+  flash_log_level
+  get_verbosity() const noexcept
+  {
+    return static_cast<flash_log_level>(this->cdata()[flash_init_verbosity_pos]);
+  }
+
   usb_byte_t*
   end() const
   {
@@ -202,6 +293,25 @@ public:
     return true;
   }
 
+  // Describes a payload which stays in the caller's buffer and is sent
+  // right after the header, only the header is filled in the packet
+  bool
+  set_data_view(const uint8_t *data, uint8_t size) noexcept
+  {
+    if(size == 0 || size & 0b11 || flash_frame_max_data_length < size)
+      return false;
+
+    this->_raw_packet.data()[flash_frame_checksum_pos] = size-1;
+    for(uint8_t i =0; i < size; i++)
+      this->_raw_packet.data()[flash_frame_checksum_pos] ^= data[i];
+
+    this->_raw_packet.data()[flash_frame_payload_size_pos] = usb_byte_t{ size };
+    this->_raw_packet.data()[common_length_pos] =
+      static_cast<usb_byte_t>(flash_frame_header_length + size);
+
+    return true;
+  }
+
   void
   set_flash_addr(const uint32_t addr) noexcept
   {
@@ -210,6 +320,12 @@ public:
                 this->_raw_packet.begin() + flash_frame_addr_pos);
   }
 
+  void
+  set_seq(const uint8_t seq) noexcept
+  {
+    this->_raw_packet.data()[flash_frame_seq_pos] = usb_byte_t{ seq };
+  }
+
 
   static std::optional<flash_frame_builder>
   make_flash_frame_builder(raw_packet packet)
@@ -226,10 +342,23 @@ public:
       usb_byte_t{ static_cast<uint8_t>(packet_type::FRAME) };
 
     packet.data()[flash_frame_checksum_pos] = usb_byte_t{0};
+    packet.data()[flash_frame_seq_pos] = usb_byte_t{0};
 
     return flash_frame_builder(packet);
   }
 
+  // Builder of the header only, the payload is given by set_data_view
+  static std::optional<flash_frame_builder>
+  make_flash_frame_header_builder(raw_packet packet)
+  {
+    if (static_cast<size_t>(packet.size()) < flash_frame_header_length)
+    {
+      return std::nullopt;
+    }
+
+    return make_flash_frame_builder(raw_packet(packet.data(), flash_frame_header_length));
+  }
+
 private:
   explicit flash_frame_builder(raw_packet packet) noexcept
     : _raw_packet(packet)
@@ -273,6 +402,12 @@ public:
     return static_cast<uint8_t>(this->cdata()[flash_frame_checksum_pos]);
   }
 
+  uint8_t
+  get_seq() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_frame_seq_pos]);
+  }
+
   uint32_t
   get_addr() const noexcept
   {
@@ -436,6 +571,7 @@ public:
     packet.data()[common_length_pos] = usb_byte_t{ flash_response_length };
     packet.data()[common_type_pos] =
       usb_byte_t{ static_cast<uint8_t>(packet_type::RESPONSE) };
+    packet.data()[flash_response_seq_pos] = usb_byte_t{ 0 };
 
     return flash_response_builder(packet);
   }
@@ -447,6 +583,26 @@ public:
       usb_byte_t{ static_cast<uint8_t>(response) };
   }
 
+  void
+  set_seq(const uint8_t seq) noexcept
+  {
+    this->_raw_packet.data()[flash_response_seq_pos] = usb_byte_t{ seq };
+  }
+
+  // Appends the crc, the packet buffer has to hold flash_response_crc_length bytes
+  bool
+  set_crc(const uint32_t crc) noexcept
+  {
+    if (static_cast<size_t>(this->_raw_packet.size()) < flash_response_crc_length)
+      return false;
+
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&crc),
+                flash_response_crc_size,
+                this->_raw_packet.begin() + flash_response_crc_pos);
+    this->_raw_packet.data()[common_length_pos] = usb_byte_t{ flash_response_crc_length };
+    return true;
+  }
+
 private:
   explicit flash_response_builder(raw_packet packet) noexcept
     : _raw_packet(packet)
@@ -474,19 +630,19 @@ public:
   size_t
   size() const
   {
-    return flash_response_length;
+    return get_lenght();
   }
 
   usb_byte_t*
   end() const
   {
-    return this->cdata() + flash_response_length;
+    return this->cdata() + get_lenght();
   }
 
   const usb_byte_t*
   cend() const
   {
-    return this->cdata() + flash_response_length;
+    return this->cdata() + get_lenght();
   }
 
   flash_response_type
@@ -495,13 +651,34 @@ public:
     return static_cast<flash_response_type>(this->data()[flash_response_type_pos]);
   }
 
+  uint8_t
+  get_seq() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_response_seq_pos]);
+  }
+
+  std::optional<uint32_t>
+  get_crc() const noexcept
+  {
+    if (get_lenght() != flash_response_crc_length)
+      return std::nullopt;
+
+    uint32_t crc = 0;
+    std::copy_n(this->cdata() + flash_response_crc_pos,
+                flash_response_crc_size,
+                reinterpret_cast<usb_byte_t*>(&crc));
+    return crc;
+  }
+
   static std::optional<flash_response>
   make_flash_response(raw_packet packet)
   {
     auto packet_buffer_size = static_cast<size_t>(packet.size());
+    auto length = static_cast<uint8_t>(packet.cdata()[common_length_pos]);
 
     if (packet_buffer_size < flash_response_length ||
-        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_response_length ||
+        (length != flash_response_length && length != flash_response_crc_length) ||
+        packet_buffer_size < length ||
         !packet.get_type().has_value() || packet.get_type() != packet_type::RESPONSE)
     {
       return std::nullopt;
@@ -628,3 +805,945 @@ private:
   {
   }
 };
+
+class flash_page_check_builder
+{
+public:
+  friend class flash_page_check;
+
+  static std::optional<flash_page_check_builder>
+  make_flash_page_check_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_page_check_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_page_check_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::PAGE_CHECK) };
+
+    return flash_page_check_builder(packet);
+  }
+
+  void
+  set_page_addr(const uint32_t addr) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_page_check_addr_size,
+                this->_raw_packet.begin() + flash_page_check_addr_pos);
+  }
+
+  void
+  set_page_size(const uint16_t page_size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&page_size),
+                flash_page_check_page_size_size,
+                this->_raw_packet.begin() + flash_page_check_page_size_pos);
+  }
+
+  void
+  set_crc(const uint32_t crc) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&crc),
+                flash_page_check_crc_size,
+                this->_raw_packet.begin() + flash_page_check_crc_pos);
+  }
+
+private:
+  explicit flash_page_check_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_page_check
+  : public raw_packet
+{
+public:
+  explicit flash_page_check(flash_page_check_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return flash_page_check_length;
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + flash_page_check_length;
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + flash_page_check_length;
+  }
+
+  uint32_t
+  get_page_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_page_check_addr_pos,
+                flash_page_check_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint16_t
+  get_page_size() const noexcept
+  {
+    uint16_t page_size = 0;
+    std::copy_n(this->cdata() + flash_page_check_page_size_pos,
+                flash_page_check_page_size_size,
+                reinterpret_cast<usb_byte_t*>(&page_size));
+    return page_size;
+  }
+
+  uint32_t
+  get_crc() const noexcept
+  {
+    uint32_t crc = 0;
+    std::copy_n(this->cdata() + flash_page_check_crc_pos,
+                flash_page_check_crc_size,
+                reinterpret_cast<usb_byte_t*>(&crc));
+    return crc;
+  }
+
+  static std::optional<flash_page_check>
+  make_flash_page_check(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_page_check_length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_page_check_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::PAGE_CHECK)
+    {
+      return std::nullopt;
+    }
+    return flash_page_check(packet);
+  }
+
+private:
+  explicit flash_page_check(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_erase_builder
+{
+public:
+  friend class flash_erase;
+
+  static std::optional<flash_erase_builder>
+  make_flash_erase_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_erase_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_erase_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::ERASE) };
+
+    return flash_erase_builder(packet);
+  }
+
+  void
+  set_range(const uint32_t addr, const uint32_t size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_erase_addr_size,
+                this->_raw_packet.begin() + flash_erase_addr_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&size),
+                flash_erase_size_size,
+                this->_raw_packet.begin() + flash_erase_size_pos);
+  }
+
+  void
+  set_page_size(const uint16_t page_size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&page_size),
+                flash_erase_page_size_size,
+                this->_raw_packet.begin() + flash_erase_page_size_pos);
+  }
+
+private:
+  explicit flash_erase_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_erase
+  : public raw_packet
+{
+public:
+  explicit flash_erase(flash_erase_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return flash_erase_length;
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + flash_erase_length;
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + flash_erase_length;
+  }
+
+  uint32_t
+  get_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_erase_addr_pos,
+                flash_erase_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint32_t
+  get_size() const noexcept
+  {
+    uint32_t size = 0;
+    std::copy_n(this->cdata() + flash_erase_size_pos,
+                flash_erase_size_size,
+                reinterpret_cast<usb_byte_t*>(&size));
+    return size;
+  }
+
+  uint16_t
+  get_page_size() const noexcept
+  {
+    uint16_t page_size = 0;
+    std::copy_n(this->cdata() + flash_erase_page_size_pos,
+                flash_erase_page_size_size,
+                reinterpret_cast<usb_byte_t*>(&page_size));
+    return page_size;
+  }
+
+  static std::optional<flash_erase>
+  make_flash_erase(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_erase_length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_erase_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::ERASE)
+    {
+      return std::nullopt;
+    }
+    return flash_erase(packet);
+  }
+
+private:
+  explicit flash_erase(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_verify_builder
+{
+public:
+  friend class flash_verify;
+
+  static std::optional<flash_verify_builder>
+  make_flash_verify_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_verify_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_verify_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::VERIFY) };
+
+    return flash_verify_builder(packet);
+  }
+
+  void
+  set_range(const uint32_t addr, const uint32_t size) noexcept
+  {
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_verify_addr_size,
+                this->_raw_packet.begin() + flash_verify_addr_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&size),
+                flash_verify_size_size,
+                this->_raw_packet.begin() + flash_verify_size_pos);
+  }
+
+private:
+  explicit flash_verify_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_verify
+  : public raw_packet
+{
+public:
+  explicit flash_verify(flash_verify_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return flash_verify_length;
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + flash_verify_length;
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + flash_verify_length;
+  }
+
+  uint32_t
+  get_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_verify_addr_pos,
+                flash_verify_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint32_t
+  get_size() const noexcept
+  {
+    uint32_t size = 0;
+    std::copy_n(this->cdata() + flash_verify_size_pos,
+                flash_verify_size_size,
+                reinterpret_cast<usb_byte_t*>(&size));
+    return size;
+  }
+
+  static std::optional<flash_verify>
+  make_flash_verify(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_verify_length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_verify_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::VERIFY)
+    {
+      return std::nullopt;
+    }
+    return flash_verify(packet);
+  }
+
+private:
+  explicit flash_verify(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_log_builder
+{
+public:
+  friend class flash_log;
+
+  static std::optional<flash_log_builder>
+  make_flash_log_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_log_header_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_log_header_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::LOG) };
+    packet.data()[flash_log_id_pos] = usb_byte_t{ 0 };
+    packet.data()[flash_log_arg_count_pos] = usb_byte_t{ 0 };
+
+    return flash_log_builder(packet);
+  }
+
+  void
+  set_id(const uint8_t id) noexcept
+  {
+    this->_raw_packet.data()[flash_log_id_pos] = usb_byte_t{ id };
+  }
+
+  bool
+  add_arg(const uint32_t arg) noexcept
+  {
+    const uint8_t count = this->_raw_packet.data()[flash_log_arg_count_pos];
+    const size_t length = flash_log_header_length + (count + 1) * flash_log_arg_size;
+
+    if(count == flash_log_max_args || static_cast<size_t>(this->_raw_packet.size()) < length)
+      return false;
+
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&arg),
+                flash_log_arg_size,
+                this->_raw_packet.begin() + flash_log_args_pos + count * flash_log_arg_size);
+    this->_raw_packet.data()[flash_log_arg_count_pos] = usb_byte_t{ static_cast<uint8_t>(count + 1) };
+    this->_raw_packet.data()[common_length_pos] = static_cast<usb_byte_t>(length);
+    return true;
+  }
+
+private:
+  explicit flash_log_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_log
+  : public raw_packet
+{
+public:
+  explicit flash_log(flash_log_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return get_lenght();
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + get_lenght();
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + get_lenght();
+  }
+
+  uint8_t
+  get_id() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_log_id_pos]);
+  }
+
+  uint8_t
+  get_arg_count() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_log_arg_count_pos]);
+  }
+
+  uint32_t
+  get_arg(const uint8_t index) const noexcept
+  {
+    uint32_t arg = 0;
+    std::copy_n(this->cdata() + flash_log_args_pos + index * flash_log_arg_size,
+                flash_log_arg_size,
+                reinterpret_cast<usb_byte_t*>(&arg));
+    return arg;
+  }
+
+  static std::optional<flash_log>
+  make_flash_log(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_log_header_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::LOG)
+    {
+      return std::nullopt;
+    }
+
+    const uint8_t count = packet.cdata()[flash_log_arg_count_pos];
+    const size_t length = flash_log_header_length + count * flash_log_arg_size;
+    if (count > flash_log_max_args || packet_buffer_size < length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != length)
+    {
+      return std::nullopt;
+    }
+    return flash_log(packet);
+  }
+
+private:
+  explicit flash_log(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_bulk_write_builder
+{
+public:
+  friend class flash_bulk_write;
+
+  static std::optional<flash_bulk_write_builder>
+  make_flash_bulk_write_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_bulk_write_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_bulk_write_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::BULK_WRITE) };
+    packet.data()[flash_bulk_write_seq_pos] = usb_byte_t{ 0 };
+
+    return flash_bulk_write_builder(packet);
+  }
+
+  void
+  set_seq(const uint8_t seq) noexcept
+  {
+    this->_raw_packet.data()[flash_bulk_write_seq_pos] = usb_byte_t{ seq };
+  }
+
+  bool
+  set_block(const uint32_t addr, const uint16_t size) noexcept
+  {
+    if(size == 0 || size & 0b11 || size > flash_bulk_write_max_size)
+      return false;
+
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_bulk_write_addr_size,
+                this->_raw_packet.begin() + flash_bulk_write_addr_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&size),
+                flash_bulk_write_size_size,
+                this->_raw_packet.begin() + flash_bulk_write_size_pos);
+    return true;
+  }
+
+private:
+  explicit flash_bulk_write_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_bulk_write
+  : public raw_packet
+{
+public:
+  explicit flash_bulk_write(flash_bulk_write_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return flash_bulk_write_length;
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + flash_bulk_write_length;
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + flash_bulk_write_length;
+  }
+
+  uint8_t
+  get_seq() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_bulk_write_seq_pos]);
+  }
+
+  uint32_t
+  get_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_bulk_write_addr_pos,
+                flash_bulk_write_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint16_t
+  get_size() const noexcept
+  {
+    uint16_t size = 0;
+    std::copy_n(this->cdata() + flash_bulk_write_size_pos,
+                flash_bulk_write_size_size,
+                reinterpret_cast<usb_byte_t*>(&size));
+    return size;
+  }
+
+  static std::optional<flash_bulk_write>
+  make_flash_bulk_write(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_bulk_write_length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_bulk_write_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::BULK_WRITE)
+    {
+      return std::nullopt;
+    }
+
+    flash_bulk_write bulk_write(packet);
+    const uint16_t size = bulk_write.get_size();
+    if (size == 0 || size & 0b11 || size > flash_bulk_write_max_size)
+    {
+      return std::nullopt;
+    }
+    return bulk_write;
+  }
+
+private:
+  explicit flash_bulk_write(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_bulk_data_builder
+{
+public:
+  friend class flash_bulk_data;
+
+  // Builder of the header only, the data is given by set_data_view
+  static std::optional<flash_bulk_data_builder>
+  make_flash_bulk_data_header_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_bulk_data_header_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_bulk_data_header_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::BULK_DATA) };
+
+    return flash_bulk_data_builder(raw_packet(packet.data(), flash_bulk_data_header_length));
+  }
+
+  // Describes data which stays in the caller's buffer and is sent
+  // right after the header
+  bool
+  set_data_view(const uint8_t size) noexcept
+  {
+    if(size == 0 || size & 0b11 || flash_bulk_data_max_data_length < size)
+      return false;
+
+    this->_raw_packet.data()[common_length_pos] =
+      static_cast<usb_byte_t>(flash_bulk_data_header_length + size);
+    return true;
+  }
+
+private:
+  explicit flash_bulk_data_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_bulk_data
+  : public raw_packet
+{
+public:
+  explicit flash_bulk_data(flash_bulk_data_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return get_lenght();
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + get_lenght();
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + get_lenght();
+  }
+
+  const usb_byte_t*
+  get_data() const noexcept
+  {
+    return this->cdata() + flash_bulk_data_payload_pos;
+  }
+
+  uint8_t
+  get_data_size() const noexcept
+  {
+    return static_cast<uint8_t>(get_lenght() - flash_bulk_data_header_length);
+  }
+
+  static std::optional<flash_bulk_data>
+  make_flash_bulk_data(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_bulk_data_header_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::BULK_DATA)
+    {
+      return std::nullopt;
+    }
+
+    const size_t length = static_cast<uint8_t>(packet.cdata()[common_length_pos]);
+    const size_t data_size = length - flash_bulk_data_header_length;
+    if (length <= flash_bulk_data_header_length || packet_buffer_size < length || data_size & 0b11)
+    {
+      return std::nullopt;
+    }
+    return flash_bulk_data(packet);
+  }
+
+private:
+  explicit flash_bulk_data(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
+
+class flash_compressed_write_builder
+{
+public:
+  friend class flash_compressed_write;
+
+  static std::optional<flash_compressed_write_builder>
+  make_flash_compressed_write_builder(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_compressed_write_length)
+    {
+      return std::nullopt;
+    }
+
+    packet.data()[common_length_pos] = usb_byte_t{ flash_compressed_write_length };
+    packet.data()[common_type_pos] =
+      usb_byte_t{ static_cast<uint8_t>(packet_type::COMPRESSED_WRITE) };
+    packet.data()[flash_compressed_write_seq_pos] = usb_byte_t{ 0 };
+
+    return flash_compressed_write_builder(packet);
+  }
+
+  void
+  set_seq(const uint8_t seq) noexcept
+  {
+    this->_raw_packet.data()[flash_compressed_write_seq_pos] = usb_byte_t{ seq };
+  }
+
+  // size of the block once it's decompressed and of its padded stream
+  bool
+  set_block(const uint32_t addr, const uint16_t size, const uint16_t data_size) noexcept
+  {
+    if(size == 0 || size & 0b11 || size > flash_bulk_write_max_size ||
+       data_size == 0 || data_size & 0b11 || data_size >= size)
+      return false;
+
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&addr),
+                flash_compressed_write_addr_size,
+                this->_raw_packet.begin() + flash_compressed_write_addr_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&size),
+                flash_compressed_write_size_size,
+                this->_raw_packet.begin() + flash_compressed_write_size_pos);
+    std::copy_n(reinterpret_cast<const usb_byte_t*>(&data_size),
+                flash_compressed_write_data_size_size,
+                this->_raw_packet.begin() + flash_compressed_write_data_size_pos);
+    return true;
+  }
+
+private:
+  explicit flash_compressed_write_builder(raw_packet packet) noexcept
+    : _raw_packet(packet)
+  {
+  }
+
+  raw_packet _raw_packet;
+};
+
+class flash_compressed_write
+  : public raw_packet
+{
+public:
+  explicit flash_compressed_write(flash_compressed_write_builder builder)
+    : raw_packet(builder._raw_packet)
+  {
+  }
+
+  size_t
+  get_lenght() const noexcept
+  {
+    return static_cast<size_t>(this->cdata()[common_length_pos]);
+  }
+
+  size_t
+  size() const
+  {
+    return flash_compressed_write_length;
+  }
+
+  usb_byte_t*
+  end() const
+  {
+    return this->cdata() + flash_compressed_write_length;
+  }
+
+  const usb_byte_t*
+  cend() const
+  {
+    return this->cdata() + flash_compressed_write_length;
+  }
+
+  uint8_t
+  get_seq() const noexcept
+  {
+    return static_cast<uint8_t>(this->cdata()[flash_compressed_write_seq_pos]);
+  }
+
+  uint32_t
+  get_addr() const noexcept
+  {
+    uint32_t addr = 0;
+    std::copy_n(this->cdata() + flash_compressed_write_addr_pos,
+                flash_compressed_write_addr_size,
+                reinterpret_cast<usb_byte_t*>(&addr));
+    return addr;
+  }
+
+  uint16_t
+  get_size() const noexcept
+  {
+    uint16_t size = 0;
+    std::copy_n(this->cdata() + flash_compressed_write_size_pos,
+                flash_compressed_write_size_size,
+                reinterpret_cast<usb_byte_t*>(&size));
+    return size;
+  }
+
+  uint16_t
+  get_data_size() const noexcept
+  {
+    uint16_t data_size = 0;
+    std::copy_n(this->cdata() + flash_compressed_write_data_size_pos,
+                flash_compressed_write_data_size_size,
+                reinterpret_cast<usb_byte_t*>(&data_size));
+    return data_size;
+  }
+
+  static std::optional<flash_compressed_write>
+  make_flash_compressed_write(raw_packet packet)
+  {
+    auto packet_buffer_size = static_cast<size_t>(packet.size());
+
+    if (packet_buffer_size < flash_compressed_write_length ||
+        static_cast<uint8_t>(packet.cdata()[common_length_pos]) != flash_compressed_write_length ||
+        !packet.get_type().has_value() || packet.get_type() != packet_type::COMPRESSED_WRITE)
+    {
+      return std::nullopt;
+    }
+
+    flash_compressed_write compressed_write(packet);
+    const uint16_t size = compressed_write.get_size();
+    const uint16_t data_size = compressed_write.get_data_size();
+    if (size == 0 || size & 0b11 || size > flash_bulk_write_max_size ||
+        data_size == 0 || data_size & 0b11 || data_size >= size)
+    {
+      return std::nullopt;
+    }
+    return compressed_write;
+  }
+
+private:
+  explicit flash_compressed_write(raw_packet packet) noexcept
+    : raw_packet(packet)
+  {
+  }
+};
@@ -13,45 +13,190 @@ enum class packet_type : uint8_t
   FRAME,
   RESET, // also send when flashing is done
   RESPONSE,
-  MSG
+  MSG,
+  PAGE_CHECK, // erase the page when its content differs
+  ERASE,      // erase the pages of one more image segment
+  VERIFY,     // crc of the target memory, answered with RESPONSE carrying it
+  LOG,        // message id of log.hpp with its raw arguments
+  BULK_WRITE, // block written by the bridge, its data follows in BULK_DATA
+  BULK_DATA,
+  COMPRESSED_WRITE // BULK_WRITE whose data is compressed with lz.hpp
+};
+
+enum class flash_erase_type : uint8_t
+{
+  MASS,  // global erase of the target flash
+  PAGES, // erase only the pages covered by the image range
+  NONE   // pages are erased on demand by PAGE_CHECK
+};
+
+// messages of log.hpp sent by the bridge, selected by INIT
+enum class flash_log_level : uint8_t
+{
+  NONE,
+  ERROR, // failures only, the default
+  INFO,  // configuration and progress of erasing
+  TRACE  // every handled packet
 };
 
 enum class flash_response_type : uint8_t
 {
   ACK=0x65,
   NACK,
-  NONE
+  NONE,
+  PAGE_MATCH, // page content is the same, nothing to write
+  PAGE_ERASED // page differed and was erased, it has to be written
 };
 
 constexpr int common_length_pos = 0x0;
 constexpr int common_type_pos   = 0x1;
 
 // flash init
-constexpr int flash_init_length = 2;
+// image address and size are used to select the pages to erase,
+// verbosity selects the log messages the bridge sends until the next INIT
+constexpr int flash_init_erase_type_size = 0x1;
+constexpr int flash_init_addr_size       = 0x4;
+constexpr int flash_init_image_size_size = 0x4;
+constexpr int flash_init_page_size_size  = 0x2;
+constexpr int flash_init_verbosity_size  = 0x1;
+constexpr int flash_init_length = flash_init_erase_type_size + flash_init_addr_size +
+                                  flash_init_image_size_size + flash_init_page_size_size +
+                                  flash_init_verbosity_size + 2;
+
+constexpr int flash_init_erase_type_pos = common_type_pos + 1;
+constexpr int flash_init_addr_pos       = common_type_pos + 2;
+constexpr int flash_init_image_size_pos = common_type_pos + 6;
+constexpr int flash_init_page_size_pos  = common_type_pos + 10;
+constexpr int flash_init_verbosity_pos  = common_type_pos + 12;
 
 // flash frame
 // payload size must devide by 4
 constexpr int flash_frame_data_size       = 0x1;
 constexpr int flash_frame_checksum_size   = 0x1;
 constexpr int flash_frame_addr_size       = 0x4;
-constexpr int flash_frame_header_length   = flash_frame_data_size + flash_frame_checksum_size + flash_frame_addr_size + 2;
-constexpr int flash_frame_max_data_length = 256 - flash_frame_header_length;
+constexpr int flash_frame_seq_size        = 0x1;
+constexpr int flash_frame_header_length   = flash_frame_data_size + flash_frame_checksum_size + flash_frame_addr_size + flash_frame_seq_size + 2;
+// the packet length has to fit the common length byte
+constexpr int flash_frame_max_length      = 255;
+constexpr int flash_frame_max_data_length = (flash_frame_max_length - flash_frame_header_length) & ~0b11;
 static_assert(flash_frame_max_data_length % 4 == 0);
-constexpr int flash_frame_max_length      = 256;
 
 constexpr int flash_frame_addr_pos          = common_type_pos + 1;
 constexpr int flash_frame_payload_size_pos  = common_type_pos + 5;
 constexpr int flash_frame_checksum_pos      = common_type_pos + 6;
-constexpr int flash_frame_payload_pos       = common_type_pos + 7;
+constexpr int flash_frame_seq_pos           = common_type_pos + 7;
+constexpr int flash_frame_payload_pos       = common_type_pos + 8;
 
 // flash reset request
 constexpr int flash_reset_length = 2;
 
 // flash reset response
-constexpr int flash_response_length = 3;
+// the sequence number is meaningful only for FRAME responses,
+// ACK carries the last frame written, NACK the frame which failed
+constexpr int flash_response_length = 4;
 constexpr int flash_response_type_length = 1;
+constexpr int flash_response_seq_length = 1;
 
 constexpr int flash_response_type_pos = common_type_pos + 1;
+constexpr int flash_response_seq_pos  = common_type_pos + 2;
+
+// response may be followed by the crc of the target memory
+constexpr int flash_response_crc_size = 4;
+constexpr int flash_response_crc_length = flash_response_length + flash_response_crc_size;
+constexpr int flash_response_crc_pos  = common_type_pos + 3;
+
+// flash page check
+// crc is calculated as in crc.hpp over the whole page
+constexpr int flash_page_check_addr_size      = 0x4;
+constexpr int flash_page_check_page_size_size = 0x2;
+constexpr int flash_page_check_crc_size       = 0x4;
+constexpr int flash_page_check_length = flash_page_check_addr_size + flash_page_check_page_size_size +
+                                        flash_page_check_crc_size + 2;
+
+constexpr int flash_page_check_addr_pos      = common_type_pos + 1;
+constexpr int flash_page_check_page_size_pos = common_type_pos + 5;
+constexpr int flash_page_check_crc_pos       = common_type_pos + 7;
+
+// flash erase
+// selects the pages to erase like the image range of INIT
+constexpr int flash_erase_addr_size      = 0x4;
+constexpr int flash_erase_size_size      = 0x4;
+constexpr int flash_erase_page_size_size = 0x2;
+constexpr int flash_erase_length = flash_erase_addr_size + flash_erase_size_size +
+                                   flash_erase_page_size_size + 2;
+
+constexpr int flash_erase_addr_pos      = common_type_pos + 1;
+constexpr int flash_erase_size_pos      = common_type_pos + 5;
+constexpr int flash_erase_page_size_pos = common_type_pos + 9;
+
+// longest the bridge waits for the target to erase, the host waits
+// for the answer to INIT and ERASE that much longer
+constexpr uint32_t flash_page_erase_timeout_ms = 50;
+constexpr uint32_t flash_mass_erase_timeout_ms = 20'000;
+
+// flash verify
+// crc of the range is calculated as in crc.hpp, size must devide by 4
+constexpr int flash_verify_addr_size = 0x4;
+constexpr int flash_verify_size_size = 0x4;
+constexpr int flash_verify_length = flash_verify_addr_size + flash_verify_size_size + 2;
+
+constexpr int flash_verify_addr_pos = common_type_pos + 1;
+constexpr int flash_verify_size_pos = common_type_pos + 5;
+
+// flash log
+// arguments are 32 bit values in the bridge byte order
+constexpr int flash_log_id_size        = 0x1;
+constexpr int flash_log_arg_count_size = 0x1;
+constexpr int flash_log_arg_size       = 0x4;
+constexpr int flash_log_max_args       = 4;
+constexpr int flash_log_header_length  = flash_log_id_size + flash_log_arg_count_size + 2;
+constexpr int flash_log_max_length     = flash_log_header_length + flash_log_max_args * flash_log_arg_size;
+
+constexpr int flash_log_id_pos        = common_type_pos + 1;
+constexpr int flash_log_arg_count_pos = common_type_pos + 2;
+constexpr int flash_log_args_pos      = common_type_pos + 3;
+
+// flash bulk write
+// the block is sent in BULK_DATA packets right after this header and is
+// answered like a FRAME, the sequence numbers of both are shared.
+// Size must devide by 4
+constexpr int flash_bulk_write_seq_size  = 0x1;
+constexpr int flash_bulk_write_addr_size = 0x4;
+constexpr int flash_bulk_write_size_size = 0x2;
+constexpr int flash_bulk_write_length = flash_bulk_write_seq_size + flash_bulk_write_addr_size +
+                                        flash_bulk_write_size_size + 2;
+constexpr int flash_bulk_write_max_size = 4096;
+
+constexpr int flash_bulk_write_seq_pos  = common_type_pos + 1;
+constexpr int flash_bulk_write_addr_pos = common_type_pos + 2;
+constexpr int flash_bulk_write_size_pos = common_type_pos + 6;
+
+// flash bulk data
+// consecutive part of the block, size must devide by 4
+constexpr int flash_bulk_data_header_length = 2;
+constexpr int flash_bulk_data_max_length    = 255;
+constexpr int flash_bulk_data_max_data_length =
+  (flash_bulk_data_max_length - flash_bulk_data_header_length) & ~0b11;
+
+constexpr int flash_bulk_data_payload_pos = common_type_pos + 1;
+
+// flash compressed write
+// the compressed block follows in BULK_DATA packets, padded with zeros to
+// whole words, and is answered like BULK_WRITE. Data size is the size of
+// the padded stream, it has to be smaller than the block
+constexpr int flash_compressed_write_seq_size       = 0x1;
+constexpr int flash_compressed_write_addr_size      = 0x4;
+constexpr int flash_compressed_write_size_size      = 0x2;
+constexpr int flash_compressed_write_data_size_size = 0x2;
+constexpr int flash_compressed_write_length = flash_compressed_write_seq_size +
+                                              flash_compressed_write_addr_size +
+                                              flash_compressed_write_size_size +
+                                              flash_compressed_write_data_size_size + 2;
+
+constexpr int flash_compressed_write_seq_pos       = common_type_pos + 1;
+constexpr int flash_compressed_write_addr_pos      = common_type_pos + 2;
+constexpr int flash_compressed_write_size_pos      = common_type_pos + 6;
+constexpr int flash_compressed_write_data_size_pos = common_type_pos + 8;
 
 // flash msg
 constexpr int flash_msg_length = 256;
@@ -65,4 +210,11 @@ constexpr int max_packet_size = std::max({ flash_init_length,
                                            flash_frame_max_length,
                                            flash_msg_length,
                                            flash_reset_length,
-                                           flash_response_length});
+                                           flash_response_crc_length,
+                                           flash_page_check_length,
+                                           flash_erase_length,
+                                           flash_verify_length,
+                                           flash_log_max_length,
+                                           flash_bulk_write_length,
+                                           flash_bulk_data_max_length,
+                                           flash_compressed_write_length});
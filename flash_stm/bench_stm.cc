@@ -0,0 +1,667 @@
+// Virtual bridge for benchmarking flash_stm without hardware. flash_stm is
+// run on a pseudo-terminal whose other end answers the packets the way the
+// bridge firmware does, with a configurable latency. The target flash is
+// kept in memory, so the crc checks of flash_stm pass only when the image
+// arrived intact.
+#include "protodef.hpp"
+#include "proto.hpp"
+#include "crc.hpp"
+#include "lz.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <cstring>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <numeric>
+#include <vector>
+#include <optional>
+#include <string>
+#include <filesystem>
+#include <getopt.h>
+#include<spdlog/spdlog.h>
+
+using namespace std::chrono_literals;
+using bench_clock = std::chrono::steady_clock;
+
+constexpr uint32_t flash_base = 0x8000000;
+constexpr uint32_t default_flash_size = 512 * 1024;
+constexpr size_t rx_buffer_size = 4096;
+const std::string usage =
+"\n[USAGE]./bench_stm [-l latency_us] [-e erase_us] [-s flash_size] flash_stm binary [flash_stm options...]\n"
+"\t -l latency_us - time the bridge takes to write one frame or block (default 0)\n"
+"\t -e erase_us - time the bridge takes to erase one page (default 0)\n"
+"\t -s flash_size - size of the emulated target flash in bytes (default 524288)\n"
+"\t flash_stm - path to the flash_stm binary which is benchmarked\n"
+"\t binary - image flashed by flash_stm\n"
+"\t flash_stm options - passed to flash_stm before the device, e.g. -w 32 -d -v\n";
+
+struct bench_config
+{
+  std::chrono::microseconds latency{0};
+  std::chrono::microseconds erase{0};
+  uint32_t flash_size = default_flash_size;
+};
+
+// Phases of flashing, time is accounted to the phase of the last received
+// packet until a packet of another phase arrives
+enum class bench_phase
+{
+  INIT,
+  ERASE,
+  WRITE,
+  VERIFY,
+  RESET,
+  COUNT
+};
+
+constexpr std::array<const char*, static_cast<size_t>(bench_phase::COUNT)> phase_names = {
+  "init", "erase", "write", "verify", "reset"
+};
+
+struct pending_response
+{
+  bench_clock::time_point due;
+  std::array<uint8_t, flash_response_crc_length> buf;
+  size_t size;
+};
+
+// State of the emulated bridge and of the target behind it
+struct virtual_bridge
+{
+  int fd = -1;
+  std::vector<uint8_t> flash;
+  uint16_t page_size = 0;
+  uint8_t expected_seq = 0;
+  // crc of the written data since INIT, RESET answers with it
+  uint32_t written_crc = crc32_init;
+  // a failed block NACKs the next command like on the bridge
+  bool failed = false;
+
+  // block which is being received
+  bool block_active = false;
+  bool block_compressed = false;
+  uint8_t block_seq = 0;
+  uint32_t block_addr = 0;
+  uint16_t block_left = 0; // bytes of the block data or stream still to come
+  std::vector<uint8_t> block;
+  lz_decoder decoder;
+
+  // responses wait until the bridge would have finished the packet,
+  // packets are handled one after another
+  std::deque<pending_response> responses;
+  bench_clock::time_point busy_until;
+
+  std::array<uint8_t, rx_buffer_size> rx;
+  size_t rx_len = 0;
+
+  // statistics
+  bool started = false;
+  bench_phase phase = bench_phase::INIT;
+  bench_clock::time_point phase_start;
+  bench_clock::time_point end;
+  std::array<bench_clock::duration, static_cast<size_t>(bench_phase::COUNT)> phase_time{};
+  bench_clock::duration init_erase{}; // erase done by INIT, reported as erase
+  uint64_t received_bytes = 0;
+  uint32_t frames = 0;
+  uint32_t compressed_frames = 0;
+  uint64_t written_bytes = 0;
+  uint32_t erased_pages = 0;
+  uint32_t nacks = 0;
+};
+
+// Appends the byte to a block decompressed by lz_decoder
+struct block_sink
+{
+  std::vector<uint8_t> &block;
+
+  void
+  put(uint8_t byte)
+  {
+    block.push_back(byte);
+  }
+
+  uint8_t
+  back(uint32_t distance) const
+  {
+    return block[block.size() - distance];
+  }
+};
+
+// The bridge takes busy time for the packet after it is done with
+// the previous ones, returns when it finishes
+static bench_clock::time_point
+bridge_busy(virtual_bridge &bridge, bench_clock::time_point now, bench_clock::duration busy)
+{
+  bridge.busy_until = std::max(bridge.busy_until, now) + busy;
+  return bridge.busy_until;
+}
+
+static void
+bridge_respond(virtual_bridge &bridge, bench_clock::time_point due, flash_response_type type,
+               uint8_t seq = 0, std::optional<uint32_t> crc = std::nullopt)
+{
+  pending_response rsp;
+  rsp.due = due;
+  auto flash_response_builder =
+    *flash_response_builder::make_flash_response_builder(raw_packet(rsp.buf.data(), rsp.buf.size()));
+  flash_response_builder.set_response(type);
+  flash_response_builder.set_seq(seq);
+  if(crc.has_value())
+    flash_response_builder.set_crc(*crc);
+  rsp.size = flash_response(flash_response_builder).size();
+  if(type == flash_response_type::NACK)
+    bridge.nacks++;
+  bridge.responses.push_back(rsp);
+}
+
+static bool
+flash_range(const virtual_bridge &bridge, uint32_t addr, uint32_t size)
+{
+  return addr >= flash_base && addr - flash_base <= bridge.flash.size() &&
+         size <= bridge.flash.size() - (addr - flash_base);
+}
+
+// Erases the pages covering the range, returns the number of them
+static uint32_t
+bridge_erase(virtual_bridge &bridge, uint32_t addr, uint32_t size)
+{
+  const uint32_t first = (addr - flash_base) / bridge.page_size;
+  const uint32_t last = std::min<uint32_t>((addr - flash_base + size + bridge.page_size - 1) / bridge.page_size,
+                                           bridge.flash.size() / bridge.page_size);
+  for(uint32_t page = first; page < last; page++)
+    std::fill_n(bridge.flash.begin() + page * bridge.page_size, bridge.page_size, 0xff);
+  bridge.erased_pages += last - first;
+  return last - first;
+}
+
+static void
+bridge_write(virtual_bridge &bridge, uint32_t addr, const uint8_t *data, size_t size)
+{
+  std::copy_n(data, size, bridge.flash.begin() + (addr - flash_base));
+  bridge.written_crc = crc32_update(bridge.written_crc, data, size);
+  bridge.written_bytes += size;
+}
+
+static void
+bridge_set_phase(virtual_bridge &bridge, bench_phase phase, bench_clock::time_point now)
+{
+  if(!bridge.started)
+  {
+    bridge.started = true;
+    bridge.phase_start = now;
+  }
+  if(phase == bridge.phase)
+    return;
+  bridge.phase_time[static_cast<size_t>(bridge.phase)] += now - bridge.phase_start;
+  bridge.phase = phase;
+  bridge.phase_start = now;
+}
+
+// Starts a block of size bytes at addr, its data follows in BULK_DATA
+static bool
+bridge_block_start(virtual_bridge &bridge, uint8_t seq, uint32_t addr, uint16_t size)
+{
+  if(seq != bridge.expected_seq || bridge.block_active || !flash_range(bridge, addr, size))
+  {
+    spdlog::error("[BENCH] Block {} at {:#x} of size {} refused", seq, addr, size);
+    return false;
+  }
+  bridge.block_active = true;
+  bridge.block_seq = seq;
+  bridge.block_addr = addr;
+  bridge.block.clear();
+  return true;
+}
+
+static void
+bridge_handle(virtual_bridge &bridge, const bench_config &config, raw_packet packet, bench_clock::time_point now)
+{
+  const auto type = packet.get_type();
+  if(!type.has_value())
+  {
+    spdlog::error("[BENCH] Unknown packet type {}", packet.data()[common_type_pos]);
+    bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+    return;
+  }
+
+  switch(*type)
+  {
+    case packet_type::INIT:
+    case packet_type::PAGE_CHECK:
+    case packet_type::ERASE:
+      bridge_set_phase(bridge, *type == packet_type::INIT ? bench_phase::INIT : bench_phase::ERASE, now);
+      break;
+    case packet_type::VERIFY:
+      bridge_set_phase(bridge, bench_phase::VERIFY, now);
+      break;
+    case packet_type::RESET:
+      bridge_set_phase(bridge, bench_phase::RESET, now);
+      break;
+    default:
+      bridge_set_phase(bridge, bench_phase::WRITE, now);
+      break;
+  }
+
+  const bool staged = *type == packet_type::FRAME || *type == packet_type::BULK_WRITE ||
+                      *type == packet_type::COMPRESSED_WRITE || *type == packet_type::BULK_DATA;
+  if(bridge.failed && *type != packet_type::INIT && *type != packet_type::RESET && !staged)
+  {
+    bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+    return;
+  }
+
+  switch(*type)
+  {
+    case packet_type::INIT:
+      {
+        auto flash_init_opt = flash_init::make_flash_init(packet);
+        if(!flash_init_opt.has_value() || flash_init_opt->get_page_size() == 0 ||
+           !flash_range(bridge, flash_init_opt->get_image_addr(), flash_init_opt->get_image_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+          return;
+        }
+        auto flash_init = *flash_init_opt;
+        bridge.page_size = flash_init.get_page_size();
+        bridge.expected_seq = 0;
+        bridge.written_crc = crc32_init;
+        bridge.failed = false;
+        bridge.block_active = false;
+
+        uint32_t pages = 0;
+        if(flash_init.get_erase_type() == flash_erase_type::MASS)
+          pages = bridge_erase(bridge, flash_base, bridge.flash.size());
+        else if(flash_init.get_erase_type() == flash_erase_type::PAGES)
+          pages = bridge_erase(bridge, flash_init.get_image_addr(), flash_init.get_image_size());
+        bridge.init_erase += pages * config.erase;
+        bridge_respond(bridge, bridge_busy(bridge, now, pages * config.erase), flash_response_type::ACK);
+      }
+      break;
+    case packet_type::ERASE:
+      {
+        auto flash_erase_opt = flash_erase::make_flash_erase(packet);
+        if(!flash_erase_opt.has_value() || bridge.page_size == 0 ||
+           !flash_range(bridge, flash_erase_opt->get_addr(), flash_erase_opt->get_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+          return;
+        }
+        const uint32_t pages = bridge_erase(bridge, flash_erase_opt->get_addr(), flash_erase_opt->get_size());
+        bridge_respond(bridge, bridge_busy(bridge, now, pages * config.erase), flash_response_type::ACK);
+      }
+      break;
+    case packet_type::PAGE_CHECK:
+      {
+        auto flash_page_check_opt = flash_page_check::make_flash_page_check(packet);
+        if(!flash_page_check_opt.has_value() || bridge.page_size == 0 ||
+           !flash_range(bridge, flash_page_check_opt->get_page_addr(), flash_page_check_opt->get_page_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+          return;
+        }
+        auto flash_page_check = *flash_page_check_opt;
+        const uint8_t *page = bridge.flash.data() + (flash_page_check.get_page_addr() - flash_base);
+        if(crc32_update(crc32_init, page, flash_page_check.get_page_size()) == flash_page_check.get_crc())
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::PAGE_MATCH);
+          return;
+        }
+        const uint32_t pages = bridge_erase(bridge, flash_page_check.get_page_addr(),
+                                            flash_page_check.get_page_size());
+        bridge_respond(bridge, bridge_busy(bridge, now, pages * config.erase), flash_response_type::PAGE_ERASED);
+      }
+      break;
+    case packet_type::VERIFY:
+      {
+        auto flash_verify_opt = flash_verify::make_flash_verify(packet);
+        if(!flash_verify_opt.has_value() ||
+           !flash_range(bridge, flash_verify_opt->get_addr(), flash_verify_opt->get_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+          return;
+        }
+        const uint8_t *data = bridge.flash.data() + (flash_verify_opt->get_addr() - flash_base);
+        bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::ACK, 0,
+                       crc32_update(crc32_init, data, flash_verify_opt->get_size()));
+      }
+      break;
+    case packet_type::RESET:
+      // the target is reset anyway, a failed block is reported after it
+      bridge.end = bridge_busy(bridge, now, 0us);
+      if(bridge.failed)
+        bridge_respond(bridge, bridge.end, flash_response_type::NACK);
+      else
+        bridge_respond(bridge, bridge.end, flash_response_type::ACK, 0, bridge.written_crc);
+      break;
+    case packet_type::FRAME:
+      {
+        auto flash_frame_opt = flash_frame::make_flash_frame(packet);
+        if(!flash_frame_opt.has_value())
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+          return;
+        }
+        auto flash_frame = *flash_frame_opt;
+        const uint8_t seq = flash_frame.get_seq();
+        const uint8_t payload_size = flash_frame.get_payload_size();
+        const uint32_t addr = flash_frame.get_addr();
+        uint8_t chksum = (uint8_t)(payload_size - 1);
+        for(uint8_t i = 0; i < payload_size; i++)
+          chksum ^= flash_frame.get_payload()[i];
+        if(payload_size == 0 || seq != bridge.expected_seq || chksum != flash_frame.get_checksum() ||
+           flash_frame.get_lenght() < (size_t)(flash_frame_payload_pos + payload_size) ||
+           !flash_range(bridge, addr, payload_size))
+        {
+          spdlog::error("[BENCH] Frame {} at {:#x} of size {} refused", seq, addr, payload_size);
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK, seq);
+          return;
+        }
+        bridge.expected_seq++;
+        bridge.frames++;
+        bridge_write(bridge, addr, flash_frame.get_payload(), payload_size);
+        bridge_respond(bridge, bridge_busy(bridge, now, config.latency), flash_response_type::ACK, seq);
+      }
+      break;
+    case packet_type::BULK_WRITE:
+      {
+        auto flash_bulk_write_opt = flash_bulk_write::make_flash_bulk_write(packet);
+        if(!flash_bulk_write_opt.has_value() ||
+           !bridge_block_start(bridge, flash_bulk_write_opt->get_seq(), flash_bulk_write_opt->get_addr(),
+                               flash_bulk_write_opt->get_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK,
+                         flash_bulk_write_opt.has_value() ? flash_bulk_write_opt->get_seq() : 0);
+          return;
+        }
+        bridge.block_compressed = false;
+        bridge.block_left = flash_bulk_write_opt->get_size();
+      }
+      break;
+    case packet_type::COMPRESSED_WRITE:
+      {
+        auto flash_compressed_write_opt = flash_compressed_write::make_flash_compressed_write(packet);
+        if(!flash_compressed_write_opt.has_value() ||
+           !bridge_block_start(bridge, flash_compressed_write_opt->get_seq(), flash_compressed_write_opt->get_addr(),
+                               flash_compressed_write_opt->get_size()))
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK,
+                         flash_compressed_write_opt.has_value() ? flash_compressed_write_opt->get_seq() : 0);
+          return;
+        }
+        bridge.block_compressed = true;
+        bridge.block_left = flash_compressed_write_opt->get_data_size();
+        bridge.decoder.reset(flash_compressed_write_opt->get_size());
+        bridge.compressed_frames++;
+      }
+      break;
+    case packet_type::BULK_DATA:
+      {
+        auto flash_bulk_data_opt = flash_bulk_data::make_flash_bulk_data(packet);
+        if(!flash_bulk_data_opt.has_value() || !bridge.block_active ||
+           flash_bulk_data_opt->get_data_size() > bridge.block_left)
+        {
+          spdlog::error("[BENCH] Unexpected bulk data");
+          bridge.block_active = false;
+          bridge.failed = true;
+          return;
+        }
+        auto flash_bulk_data = *flash_bulk_data_opt;
+        const uint8_t *data = flash_bulk_data.get_data();
+        const uint8_t size = flash_bulk_data.get_data_size();
+        bridge.block_left -= size;
+        if(!bridge.block_compressed)
+          bridge.block.insert(bridge.block.end(), data, data + size);
+        else if(!bridge.failed)
+        {
+          block_sink sink{bridge.block};
+          if(!bridge.decoder.feed(data, size, sink) || (bridge.block_left == 0 && !bridge.decoder.done()))
+          {
+            spdlog::error("[BENCH] Compressed block {} corrupt", bridge.block_seq);
+            bridge.failed = true;
+          }
+        }
+        if(bridge.block_left != 0)
+          return;
+
+        bridge.block_active = false;
+        if(bridge.failed)
+        {
+          bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK, bridge.block_seq);
+          return;
+        }
+        bridge.expected_seq++;
+        bridge.frames++;
+        bridge_write(bridge, bridge.block_addr, bridge.block.data(), bridge.block.size());
+        bridge_respond(bridge, bridge_busy(bridge, now, config.latency), flash_response_type::ACK, bridge.block_seq);
+      }
+      break;
+    default:
+      spdlog::error("[BENCH] Packet type {} isn't sent to the bridge", static_cast<int>(*type));
+      bridge_respond(bridge, bridge_busy(bridge, now, 0us), flash_response_type::NACK);
+      break;
+  }
+}
+
+// Handles the complete packets read from the pseudo-terminal
+static bool
+bridge_receive(virtual_bridge &bridge, const bench_config &config)
+{
+  const ssize_t n = read(bridge.fd, bridge.rx.data() + bridge.rx_len, bridge.rx.size() - bridge.rx_len);
+  if(n <= 0)
+    return n == 0 || errno == EAGAIN || errno == EINTR;
+
+  const auto now = bench_clock::now();
+  bridge.received_bytes += n;
+  bridge.rx_len += n;
+
+  size_t pos = 0;
+  while(bridge.rx_len - pos >= 2 && bridge.rx[pos + common_length_pos] <= bridge.rx_len - pos)
+  {
+    const uint8_t length = bridge.rx[pos + common_length_pos];
+    if(length < 2)
+    {
+      spdlog::error("[BENCH] Packet of length {} received", length);
+      return false;
+    }
+    bridge_handle(bridge, config, raw_packet(bridge.rx.data() + pos, length), now);
+    pos += length;
+  }
+  std::memmove(bridge.rx.data(), bridge.rx.data() + pos, bridge.rx_len - pos);
+  bridge.rx_len -= pos;
+  return true;
+}
+
+// Sends the responses which are due, returns the time until the next one
+static int
+bridge_transmit(virtual_bridge &bridge)
+{
+  const auto now = bench_clock::now();
+  while(!bridge.responses.empty() && bridge.responses.front().due <= now)
+  {
+    const auto &rsp = bridge.responses.front();
+    if(write(bridge.fd, rsp.buf.data(), rsp.size) != static_cast<ssize_t>(rsp.size))
+      spdlog::error("[BENCH] Writing response failed, err={}", errno);
+    bridge.responses.pop_front();
+  }
+  if(bridge.responses.empty())
+    return 100;
+  const auto wait = std::chrono::ceil<std::chrono::milliseconds>(bridge.responses.front().due - now);
+  return static_cast<int>(std::max<int64_t>(wait.count(), 0));
+}
+
+static std::optional<std::string>
+open_pty(virtual_bridge &bridge)
+{
+  bridge.fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if(bridge.fd < 0 || grantpt(bridge.fd) != 0 || unlockpt(bridge.fd) != 0)
+  {
+    spdlog::error("[BENCH] Creating pseudo-terminal failed, err={}", errno);
+    return std::nullopt;
+  }
+
+  struct termios tty;
+  if(tcgetattr(bridge.fd, &tty) == 0)
+  {
+    cfmakeraw(&tty);
+    tcsetattr(bridge.fd, TCSANOW, &tty);
+  }
+  fcntl(bridge.fd, F_SETFL, fcntl(bridge.fd, F_GETFL) | O_NONBLOCK);
+  return std::string(ptsname(bridge.fd));
+}
+
+// Accounts the time up to the last RESET response, or up to now when
+// flash_stm didn't get that far, to the last phase
+static void
+bridge_finish(virtual_bridge &bridge)
+{
+  if(!bridge.started)
+    return;
+  if(bridge.end < bridge.phase_start)
+    bridge.end = bench_clock::now();
+  bridge.phase_time[static_cast<size_t>(bridge.phase)] += bridge.end - bridge.phase_start;
+  bridge.phase_start = bridge.end;
+
+  auto &init = bridge.phase_time[static_cast<size_t>(bench_phase::INIT)];
+  const auto init_erase = std::min(init, std::chrono::duration_cast<bench_clock::duration>(bridge.init_erase));
+  init -= init_erase;
+  bridge.phase_time[static_cast<size_t>(bench_phase::ERASE)] += init_erase;
+}
+
+static void
+print_report(const virtual_bridge &bridge, double total)
+{
+  auto seconds = [](bench_clock::duration d) { return std::chrono::duration<double>(d).count(); };
+  const double write = seconds(bridge.phase_time[static_cast<size_t>(bench_phase::WRITE)]);
+  const double session = seconds(std::accumulate(bridge.phase_time.begin(), bridge.phase_time.end(),
+                                                 bench_clock::duration::zero()));
+
+  std::string phases;
+  for(size_t i = 0; i < phase_names.size(); i++)
+    phases += fmt::format("{}{} {:.3f}s", i ? ", " : "", phase_names[i], seconds(bridge.phase_time[i]));
+
+  spdlog::info("[BENCH] flash_stm ran {:.3f}s, flashing {:.3f}s", total, session);
+  spdlog::info("[BENCH] Phases: {}", phases);
+  spdlog::info("[BENCH] Frames {} ({} compressed), written {} bytes, erased {} pages, received {} bytes, NACKs {}",
+               bridge.frames, bridge.compressed_frames, bridge.written_bytes, bridge.erased_pages,
+               bridge.received_bytes, bridge.nacks);
+  if(write > 0)
+    spdlog::info("[BENCH] Write: {:.1f} frames/s, {:.0f} bytes/s, {:.0f} USB bytes/s",
+                 bridge.frames / write, bridge.written_bytes / write, bridge.received_bytes / write);
+}
+
+int main(int argc, char* argv[])
+{
+  bench_config config;
+
+  int opt;
+  // options after the flash_stm path belong to flash_stm
+  while((opt = getopt(argc, argv, "+l:e:s:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'l':
+        config.latency = std::chrono::microseconds(strtoul(optarg, nullptr, 10));
+        break;
+      case 'e':
+        config.erase = std::chrono::microseconds(strtoul(optarg, nullptr, 10));
+        break;
+      case 's':
+        config.flash_size = strtoul(optarg, nullptr, 10);
+        if(config.flash_size == 0 || config.flash_size % 4 != 0)
+        {
+          spdlog::error("Invalid flash size {}", optarg);
+          spdlog::info("{}", usage);
+          return -1;
+        }
+        break;
+      default:
+        spdlog::info("{}", usage);
+        return -1;
+    }
+  }
+
+  if(argc - optind < 2)
+  {
+    spdlog::info("{}", usage);
+    return -1;
+  }
+
+  virtual_bridge bridge;
+  bridge.flash.assign(config.flash_size, 0xff);
+  const auto device = open_pty(bridge);
+  if(!device.has_value())
+    return -1;
+
+  // flash_stm [flash_stm options...] device binary
+  std::vector<char*> flash_stm_args = {argv[optind]};
+  for(int i = optind + 2; i < argc; i++)
+    flash_stm_args.push_back(argv[i]);
+  flash_stm_args.push_back(const_cast<char*>(device->c_str()));
+  flash_stm_args.push_back(argv[optind + 1]);
+  flash_stm_args.push_back(nullptr);
+
+  // the pseudo-terminals come and go, the bitrates flash_stm negotiates
+  // for them are kept away from the cache of the real devices
+  char cache_dir[] = "/tmp/bench_stm.XXXXXX";
+  if(mkdtemp(cache_dir) == nullptr)
+  {
+    spdlog::error("[BENCH] Creating cache directory failed, err={}", errno);
+    return -1;
+  }
+
+  const auto start = bench_clock::now();
+  const pid_t pid = fork();
+  if(pid < 0)
+  {
+    spdlog::error("[BENCH] fork failed, err={}", errno);
+    std::filesystem::remove_all(cache_dir);
+    return -1;
+  }
+  if(pid == 0)
+  {
+    close(bridge.fd);
+    setenv("XDG_CACHE_HOME", cache_dir, 1);
+    execv(flash_stm_args[0], flash_stm_args.data());
+    spdlog::error("[BENCH] Running {} failed, err={}", flash_stm_args[0], errno);
+    _exit(127);
+  }
+
+  int status = 0;
+  while(waitpid(pid, &status, WNOHANG) == 0)
+  {
+    pollfd pfd = {bridge.fd, POLLIN, 0};
+    // the slave end isn't open before flash_stm opens it, POLLHUP is
+    // reported until then
+    if(poll(&pfd, 1, std::min(bridge_transmit(bridge), 10)) <= 0)
+      continue;
+    if(!(pfd.revents & POLLIN))
+    {
+      usleep(1000);
+      continue;
+    }
+    if(!bridge_receive(bridge, config))
+    {
+      kill(pid, SIGTERM);
+      waitpid(pid, &status, 0);
+      break;
+    }
+  }
+  const double total = std::chrono::duration<double>(bench_clock::now() - start).count();
+  std::error_code err;
+  std::filesystem::remove_all(cache_dir, err);
+
+  bridge_finish(bridge);
+  print_report(bridge, total);
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    spdlog::error("[BENCH] flash_stm failed");
+    return 1;
+  }
+  return 0;
+}
@@ -1,179 +1,344 @@
 #include "protodef.hpp"
 #include <stdio.h>
 #include "proto.hpp"
+#include "crc.hpp"
+#include "log.hpp"
+#include "lz.hpp"
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <thread>
+#include <poll.h>
+#include <elf.h>
 #include <termios.h>
-#include <string.h>
-#include <atomic>
+#include <cstring>
 #include <array>
-#include <condition_variable>
+#include <algorithm>
 #include <chrono>
+#include <vector>
+#include <optional>
+#include <getopt.h>
+#include <fstream>
+#include <filesystem>
+#include <sstream>
+#include <map>
 #include<spdlog/spdlog.h>
 
 using namespace std::chrono_literals;
 
-/* TODO change the max size to  flash_frame_max_data_lengt
- * when STM will reasemble the packets received via the USB CDC
- */
-constexpr uint8_t max_usb_cdc_transfer_size = 64;
+constexpr int default_block_window = 8;
+// bytes of the image sent in one BULK_WRITE, the default window of them
+// still fits the write buffers of the tty driver
+constexpr size_t bulk_block_size = 2048;
+static_assert(bulk_block_size <= flash_bulk_write_max_size);
+// sequence numbers are 8 bit, keep the window far below the wrap around
+constexpr int max_block_window = 128;
+constexpr uint32_t default_page_size = 1024;
+// pages are found by dividing the address, STM32 pages are 256 bytes and up
+constexpr uint32_t min_page_size = 256;
+constexpr uint32_t default_bitrate = 115200;
 const std::string usage =
-"\n[USAGE]./flash_stm  device binary [debug_level]\n"
-"\t device - path to device file in /dev directory usually: /dev/ttyACM0\n"
-"\t binary - path to binary to flash\n"
-"\t debug_level - one of: info, debug, trace\n";
+"\n[USAGE]./flash_stm [-w window] [-p page_size] [-m | -d] [-b bitrate | -B] [-v] [-n] device [device...] binary [debug_level]\n"
+"\t -w window - number of blocks sent without waiting for ACK (1-128, default 8)\n"
+"\t -p page_size - flash page size of the target in bytes, a power of two from 256 (default 1024)\n"
+"\t -m - mass erase the whole flash instead of the pages covered by the binary\n"
+"\t -d - differential mode, only pages which differ from the target are erased and written\n"
+"\t -b bitrate - target UART bitrate (default 115200 or the one negotiated before for the device)\n"
+"\t -B - negotiate the highest bitrate accepted by the target and remember it for the device\n"
+"\t -v, --verify - compare crc of the written regions calculated by the bridge with the image\n"
+"\t -n - send the blocks uncompressed\n"
+"\t device - path to device file in /dev directory usually: /dev/ttyACM0, all given devices are flashed at once\n"
+"\t binary - path to binary to flash, raw .bin flashed from 0x8000000, Intel .hex or ELF\n"
+"\t debug_level - one of: info, debug, trace, debug and trace also raise the bridge verbosity\n";
 
 constexpr uint32_t start_flash_addr = 0x8000000;
 
-std::condition_variable cv_response;
-std::mutex mtx_response;
+constexpr auto response_timeout = 10s;
+// the bridge reads a verified region from the target at the UART bitrate,
+// so a region has to be checked well within response_timeout
+constexpr size_t verify_region_size = 16 * 1024;
+constexpr int write_timeout_ms = 1000;
+constexpr auto progress_interval = 100ms;
+// enough for many responses, the bridge packs them into USB transfers
+constexpr size_t rx_buffer_size = 4096;
 
-flash_response_type response = flash_response_type::NONE;
+struct bitrate_speed
+{
+  uint32_t bitrate;
+  speed_t speed;
+};
+
+// bitrates the bridge UART is set to, the negotiation probes them in order
+// starting with the default, the bootloader detects the rate from INIT byte
+constexpr std::array<bitrate_speed, 10> bitrates = {{
+  { 9600, B9600 },
+  { 19200, B19200 },
+  { 38400, B38400 },
+  { 57600, B57600 },
+  { 115200, B115200 },
+  { 230400, B230400 },
+  { 460800, B460800 },
+  { 576000, B576000 },
+  { 921600, B921600 },
+  { 1000000, B1000000 },
+}};
 
-std::atomic_bool finish = false;
+struct bridge_response
+{
+  flash_response_type type;
+  uint8_t seq;
+  std::optional<uint32_t> crc;
+};
 
+// Devices are nonblocking, a full tty output buffer is waited for
 bool
-write_all(int fd, uint8_t *buf, size_t size)
+write_all(int fd, const uint8_t *buf, size_t size)
 {
-  size_t written;
   while(size)
   {
-    written = write(fd, buf, size);
+    const ssize_t written = write(fd, buf, size);
     if(written == -1)
+    {
+      pollfd out{fd, POLLOUT, 0};
+      if(errno == EAGAIN && poll(&out, 1, write_timeout_ms) == 1)
+        continue;
       return false;
+    }
+    buf += written;
     size -= written;
   }
   return true;
 }
 
-void
-read_some(int fd, uint8_t *buf, int to_read)
+static bool
+send_init_packet(int fd, flash_erase_type erase_type, uint32_t image_addr, uint32_t image_size,
+                 uint16_t page_size, flash_log_level verbosity)
 {
-  int cnt = 0;
-  while(cnt < to_read)
-    if(read(fd, buf+cnt, 1) > 0 || finish)
-      cnt++;
+  uint8_t buf[flash_init_length];
+  raw_packet raw_packet(buf, flash_init_length);
+  auto flash_init_builder_opt = flash_init_builder::make_flash_init_builder(raw_packet);
+  if(!flash_init_builder_opt.has_value())
+  {
+    spdlog::error("[FLASHER] Creating init packet failed\n");
+    return false;
+  }
+
+  auto flash_init_builder = *flash_init_builder_opt;
+  flash_init_builder.set_erase_type(erase_type);
+  flash_init_builder.set_image_range(image_addr, image_size);
+  flash_init_builder.set_page_size(page_size);
+  flash_init_builder.set_verbosity(verbosity);
+  flash_init flash_init_packet(flash_init_builder);
+
+  return write_all(fd, flash_init_packet.begin(), flash_init_packet.size()); 
 }
 
-void receive_msg(int device)
+// Writes all of the given buffers with as few syscalls as possible,
+// the data is taken directly from the image
+static bool
+writev_all(int fd, iovec *iov, int cnt)
 {
-  uint8_t buf[max_packet_size];
-  int bytes_to_rcv=0;
-  raw_packet packet(buf, max_packet_size);
-  
-  while(!finish)
+  iovec *cur = iov;
+  while(cnt > 0)
   {
-    // read proto header
-    read_some(device, buf, 2);
+    const ssize_t written = writev(fd, cur, cnt);
+    if(written == -1)
+    {
+      pollfd out{fd, POLLOUT, 0};
+      if(errno == EAGAIN && poll(&out, 1, write_timeout_ms) == 1)
+        continue;
+      return false;
+    }
 
-    switch(buf[common_type_pos])
+    size_t left = written;
+    while(cnt > 0 && left >= cur->iov_len)
     {
-      case (uint8_t)packet_type::RESPONSE:
-        {
-         std::unique_lock<std::mutex> lk(mtx_response);
-         read_some(device, buf + flash_response_type_pos, 1);
-         auto flash_response_packet_opt = flash_response::make_flash_response(packet);
-         if(!flash_response_packet_opt.has_value())
-           return;
-
-         auto flash_response_packet = flash_response_packet_opt.value();
-         response = flash_response_packet.get_response();
-         cv_response.notify_all();
-         spdlog::debug("[STM32 RESPONSE] {}", flash_response_packet.get_response() == flash_response_type::ACK ? "ACK" : "NACK");
-        }
-        break;
+      left -= cur->iov_len;
+      cur++;
+      cnt--;
+    }
+    if(cnt > 0)
+    {
+      cur->iov_base = static_cast<uint8_t*>(cur->iov_base) + left;
+      cur->iov_len -= left;
+    }
+  }
+  return true;
+}
 
-      case (uint8_t)packet_type::MSG:
-      {
-        read_some(device, buf + flash_msg_payload_size_pos, 1);
-        read_some(device, buf + flash_msg_payload_pos, buf[flash_msg_payload_size_pos]);
-        auto flash_msg_packet_opt = flash_msg::make_flash_msg(packet);
-        if(!flash_msg_packet_opt.has_value())
-          return;
+// Sends the block header followed by the data in BULK_DATA packets
+static bool
+send_block(int fd, uint8_t *header, size_t header_length, const uint8_t *data, size_t size)
+{
+  constexpr size_t max_parts = flash_bulk_write_max_size / flash_bulk_data_max_data_length + 1;
+  uint8_t data_headers[max_parts][flash_bulk_data_header_length];
+  iovec iov[1 + 2 * max_parts];
+  int cnt = 0;
 
-        auto flash_msg_packet = flash_msg_packet_opt.value();
-        spdlog::debug("[STM32 MSG] {}", flash_msg_packet.get_msg());
-      }
-      break;
-      default:
-      spdlog::error("[FLASHER] Incorrect frame {} {}", buf[0], buf[1]);
-        continue;
+  iov[cnt++] = {header, header_length};
+  for(size_t pos = 0, part = 0; pos < size; pos += flash_bulk_data_max_data_length, part++)
+  {
+    const size_t part_size = std::min<size_t>(size - pos, flash_bulk_data_max_data_length);
+    auto flash_bulk_data_builder_opt = flash_bulk_data_builder::make_flash_bulk_data_header_builder(
+      raw_packet(data_headers[part], flash_bulk_data_header_length));
+    if(!flash_bulk_data_builder_opt.has_value() || !flash_bulk_data_builder_opt->set_data_view(part_size))
+    {
+      spdlog::error("[FLASHER] Creating bulk data packet failed. Can't flash device");
+      return false;
     }
+    iov[cnt++] = {data_headers[part], flash_bulk_data_header_length};
+    iov[cnt++] = {const_cast<uint8_t*>(data + pos), part_size};
   }
+
+  return writev_all(fd, iov, cnt);
 }
-// There are two possible responses
-// ACK when the transation was performed correctly
-// NACK when transaction failed
-//
-// return true when we receive ACK
-// otherwise return NACK
-bool
-wait_for_response()
+
+// Sends a block which the bridge writes with full Write Memory commands.
+// The block follows its header in BULK_DATA packets, size must devide by 4
+static bool
+send_bulk_write(int fd, uint32_t addr, uint8_t seq, const uint8_t *data, size_t size)
 {
-  std::unique_lock<std::mutex> lk(mtx_response);
-  if(!cv_response.wait_for(lk, 10000ms, []{return response != flash_response_type::NONE;})) 
+  uint8_t header[flash_bulk_write_length];
+  auto flash_bulk_write_builder_opt =
+    flash_bulk_write_builder::make_flash_bulk_write_builder(raw_packet(header, flash_bulk_write_length));
+  if(!flash_bulk_write_builder_opt.has_value())
+  {
+    spdlog::error("[FLASHER] Creating bulk write packet failed. Can't flash device");
     return false;
-  auto rsp = response;
-  response = flash_response_type::NONE;
-  return rsp == flash_response_type::ACK;
+  }
+
+  auto flash_bulk_write_builder = *flash_bulk_write_builder_opt;
+  flash_bulk_write_builder.set_seq(seq);
+  if(!flash_bulk_write_builder.set_block(addr, size))
+  {
+    spdlog::error("[FLASHER] Incorrect block {:#x} of size {}. Can't flash device", addr, size);
+    return false;
+  }
+  return send_block(fd, header, flash_bulk_write_length, data, size);
 }
 
+// Sends a block of size bytes compressed to the stream, the bridge
+// decompresses it before writing. The stream is padded to whole words
 static bool
-send_init_packet(int fd)
+send_compressed_write(int fd, uint32_t addr, uint8_t seq, size_t size, const uint8_t *stream, size_t stream_size)
 {
-  uint8_t buf[flash_init_length];
-  raw_packet raw_packet(buf, flash_init_length);
-  auto flash_init_builder_opt = flash_init_builder::make_flash_init_builder(raw_packet);
-  if(!flash_init_builder_opt.has_value())
+  uint8_t header[flash_compressed_write_length];
+  auto flash_compressed_write_builder_opt = flash_compressed_write_builder::make_flash_compressed_write_builder(
+    raw_packet(header, flash_compressed_write_length));
+  if(!flash_compressed_write_builder_opt.has_value())
   {
-    spdlog::error("[FLASHER] Creating init packet failed\n");
+    spdlog::error("[FLASHER] Creating compressed write packet failed. Can't flash device");
     return false;
   }
 
-  auto flash_init_builder = *flash_init_builder_opt;
-  flash_init flash_init_packet(flash_init_builder);
+  auto flash_compressed_write_builder = *flash_compressed_write_builder_opt;
+  flash_compressed_write_builder.set_seq(seq);
+  if(!flash_compressed_write_builder.set_block(addr, size, stream_size))
+  {
+    spdlog::error("[FLASHER] Incorrect compressed block {:#x} of size {}. Can't flash device", addr, size);
+    return false;
+  }
+  return send_block(fd, header, flash_compressed_write_length, stream, stream_size);
+}
 
-  return write_all(fd, flash_init_packet.begin(), flash_init_packet.size()); 
+// Compresses a block into stream, nullopt when it doesn't get at least
+// a word smaller. The stream is padded with zeros to whole words
+static std::optional<size_t>
+compress_block(const uint8_t *data, size_t size, uint8_t *stream)
+{
+  if(size < 4)
+    return std::nullopt;
+  const auto compressed = lz_compress(data, size, stream, size - 4);
+  if(!compressed.has_value())
+    return std::nullopt;
+  const size_t padded = (*compressed + 3) & ~size_t(3);
+  std::fill(stream + *compressed, stream + padded, 0);
+  return padded;
 }
 
-// data passed to buffer should always deivde by 4
-static bool
-send_frame(int fd, uint32_t addr, uint8_t *payload, size_t payload_size)
+// Erased flash reads as 0xff, so the leading and trailing 0xff words
+// of a payload don't have to be written. Returns the number of bytes
+// which are left, offset is set to the first word which has to be written.
+static size_t
+trim_erased(const uint8_t *payload, size_t size, size_t &offset)
 {
-  uint8_t buf[flash_frame_max_length];
-  raw_packet raw_packet(buf, max_usb_cdc_transfer_size);
-  auto flash_frame_builder_opt = flash_frame_builder::make_flash_frame_builder(raw_packet);
+  auto erased_word = [payload](size_t pos) {
+    return std::all_of(payload + pos, payload + pos + 4, [](uint8_t b) { return b == 0xff; });
+  };
+
+  size_t begin = 0, end = size;
+  while(end - begin >= 4 && erased_word(begin))
+    begin += 4;
+  while(end - begin >= 4 && erased_word(end - 4))
+    end -= 4;
 
-  if(!flash_frame_builder_opt.has_value())
+  offset = begin;
+  return end - begin;
+}
+
+// Asks the bridge to compare the target page with the given content,
+// the bridge answers with PAGE_MATCH or PAGE_ERASED
+static bool
+send_page_check(int fd, uint32_t addr, const uint8_t *page, uint16_t page_size)
+{
+  uint8_t buf[flash_page_check_length];
+  raw_packet raw_packet(buf, flash_page_check_length);
+  auto flash_page_check_builder_opt = flash_page_check_builder::make_flash_page_check_builder(raw_packet);
+  if(!flash_page_check_builder_opt.has_value())
   {
-    spdlog::error("[FLASHER] Creating frame packet failed. Can't flash device");
+    spdlog::error("[FLASHER] Creating page check packet failed");
     return false;
   }
 
-  auto flash_frame_builder = *flash_frame_builder_opt;
+  auto flash_page_check_builder = *flash_page_check_builder_opt;
+  flash_page_check_builder.set_page_addr(addr);
+  flash_page_check_builder.set_page_size(page_size);
+  flash_page_check_builder.set_crc(crc32_update(crc32_init, page, page_size));
+  flash_page_check flash_page_check_packet(flash_page_check_builder);
 
-  flash_frame_builder.set_flash_addr(addr);
+  return write_all(fd, flash_page_check_packet.begin(), flash_page_check_packet.size());
+}
 
-  if(!flash_frame_builder.set_data(payload, payload_size))
+// Asks the bridge for crc of the target memory, the answer carries it
+static bool
+send_verify_packet(int fd, uint32_t addr, uint32_t size)
+{
+  uint8_t buf[flash_verify_length];
+  raw_packet raw_packet(buf, flash_verify_length);
+  auto flash_verify_builder_opt = flash_verify_builder::make_flash_verify_builder(raw_packet);
+  if(!flash_verify_builder_opt.has_value())
   {
-    spdlog::error("[FLASHER] Adding payload to frame failed. Can't flash device");
+    spdlog::error("[FLASHER] Creating verify packet failed");
     return false;
   }
-  flash_frame flash_frame_packet(flash_frame_builder);
 
-  return write_all(fd, flash_frame_packet.data(), flash_frame_packet.size());
+  auto flash_verify_builder = *flash_verify_builder_opt;
+  flash_verify_builder.set_range(addr, size);
+  flash_verify flash_verify_packet(flash_verify_builder);
+
+  return write_all(fd, flash_verify_packet.begin(), flash_verify_packet.size());
 }
 
+// Erases the pages of a segment which follows the one erased by INIT
 static bool
-send_frame_with_correct_endian(int fd, uint32_t addr, uint8_t *payload, size_t payload_size)
+send_erase_packet(int fd, uint32_t addr, uint32_t size, uint16_t page_size)
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  return send_frame(fd, __builtin_bswap32(addr), payload, payload_size);
-#else
-  return send_frame(fd, addr, payload, payload_size);
-#endif
+  uint8_t buf[flash_erase_length];
+  raw_packet raw_packet(buf, flash_erase_length);
+  auto flash_erase_builder_opt = flash_erase_builder::make_flash_erase_builder(raw_packet);
+  if(!flash_erase_builder_opt.has_value())
+  {
+    spdlog::error("[FLASHER] Creating erase packet failed");
+    return false;
+  }
+
+  auto flash_erase_builder = *flash_erase_builder_opt;
+  flash_erase_builder.set_range(addr, size);
+  flash_erase_builder.set_page_size(page_size);
+  flash_erase flash_erase_packet(flash_erase_builder);
+
+  return write_all(fd, flash_erase_packet.begin(), flash_erase_packet.size());
 }
 
 static bool
@@ -194,8 +359,63 @@ send_reset_packet(int fd)
   return write_all(fd, flash_reset_packet.begin(), flash_reset_packet.size()); 
 }
 
+static std::optional<speed_t>
+bitrate_to_speed(uint32_t bitrate)
+{
+  auto it = std::find_if(bitrates.begin(), bitrates.end(),
+                         [bitrate](const bitrate_speed &b) { return b.bitrate == bitrate; });
+  if(it == bitrates.end())
+    return std::nullopt;
+  return it->speed;
+}
+
+// Negotiated bitrates are kept as "device bitrate" lines
+static std::string
+bitrate_cache_path()
+{
+  if(const char *cache = getenv("XDG_CACHE_HOME"); cache != nullptr && *cache != '\0')
+    return std::string(cache) + "/flash_stm_bitrates";
+  if(const char *home = getenv("HOME"); home != nullptr)
+    return std::string(home) + "/.cache/flash_stm_bitrates";
+  return {};
+}
+
+static std::map<std::string, uint32_t>
+load_bitrate_cache()
+{
+  std::map<std::string, uint32_t> cache;
+  std::ifstream file(bitrate_cache_path());
+  std::string line;
+  while(std::getline(file, line))
+  {
+    std::istringstream fields(line);
+    std::string device;
+    uint32_t bitrate = 0;
+    if(fields >> device >> bitrate && bitrate_to_speed(bitrate).has_value())
+      cache[device] = bitrate;
+  }
+  return cache;
+}
+
+static void
+store_cached_bitrate(const std::string &device, uint32_t bitrate)
+{
+  const std::string path = bitrate_cache_path();
+  auto cache = load_bitrate_cache();
+  cache[device] = bitrate;
+
+  std::error_code err;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), err);
+  std::ofstream file(path, std::ios::trunc);
+  for(const auto &[cached_device, cached_bitrate] : cache)
+    file << cached_device << ' ' << cached_bitrate << '\n';
+  if(!file)
+    spdlog::warn("[FLASHER] Can't store negotiated bitrate in {}", path);
+}
+
+// The bridge follows the tty bitrate, the change reaches it as CDC SET_LINE_CODING
 static bool
-set_device_params(int fd)
+set_device_params(int fd, speed_t speed)
 {
   struct termios tty;
 
@@ -225,11 +445,11 @@ set_device_params(int fd)
   tty.c_oflag &= ~OPOST; // Prevent special interpretation of output bytes (e.g. newline chars)
   tty.c_oflag &= ~ONLCR; // Prevent conversion of newline to carriage return/line feed
 
-  tty.c_cc[VTIME] = 10;    // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
+  tty.c_cc[VTIME] = 0;    // reads return what is available, waiting is done by poll
   tty.c_cc[VMIN] = 0;
 
   /* Set Baud Rate */
-  cfsetspeed(&tty, (speed_t)B115200);
+  cfsetspeed(&tty, speed);
 
   if ( tcsetattr ( fd, TCSANOW, &tty ) != 0) {
     spdlog::error("[FLASHER] Setting device attributes failed, err={}", errno);
@@ -238,192 +458,1318 @@ set_device_params(int fd)
   return true;
 }
 
-int main(int argc, char* argv[])
+struct flash_config
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  uint32_t flash_address = __builtin_bswap32(start_flash_addr);
-#else
-  uint32_t flash_address = start_flash_addr;
-#endif
-
-  int device, binary;
-  uint8_t packet_buf[max_packet_size];
-  uint8_t file_buf[flash_frame_max_data_length];
-  size_t file_size = 0, total_bytes_read = 0;
-  size_t bytes_read = 0, next_read = 0, to_send = 0;
-  struct stat st;
-  constexpr uint8_t max_payload = max_usb_cdc_transfer_size - flash_frame_header_length;
+  flash_erase_type erase_type = flash_erase_type::PAGES;
+  uint32_t page_size = default_page_size;
+  uint32_t block_window = default_block_window;
+  uint32_t bitrate = 0; // 0 means the cached one or the default
+  bool negotiate = false;
+  bool verify = false;
+  bool compress = true;
+  flash_log_level verbosity = flash_log_level::ERROR; // follows debug_level
+};
 
-  constexpr uint8_t progres_bar_width = 25;
-  std::array<char, progres_bar_width> progress_bar;
-  progress_bar.fill(' ');
-  bool disable_proggress = false;
+// Address range loaded from the input file
+struct image_range
+{
+  uint32_t addr;
+  const uint8_t *data;
+  size_t size;
+};
+
+// Continuous part of the image flashed at addr. It is padded with 0xff
+// to whole words, or to whole pages in the differential mode. The aligned
+// part is taken directly from the loaded file, only the rest is copied
+// to tail, the padding is added there
+struct image_segment
+{
+  uint32_t addr = 0;
+  size_t size = 0; // size with the padding
+  const uint8_t *mapped = nullptr;
+  size_t tail_pos = 0; // segment offset where tail starts
+  std::vector<uint8_t> tail;
+};
+
+// The image is loaded once and shared by all the devices
+struct flash_image
+{
+  size_t size = 0;        // loaded bytes without the padding
+  size_t padded_size = 0; // bytes of all the segments
+  std::vector<image_segment> segments;
 
-  if(argc < 3)
+  const uint8_t *file = nullptr; // mapping of the input file
+  size_t file_size = 0;
+  std::vector<std::vector<uint8_t>> hex_data; // data of Intel HEX records
+};
+
+static const uint8_t *
+image_data(const image_segment &segment, size_t pos)
+{
+  return pos < segment.tail_pos ? segment.mapped + pos : segment.tail.data() + (pos - segment.tail_pos);
+}
+
+// crc of size bytes of the segment from pos, as the bridge calculates it
+static uint32_t
+segment_crc(const image_segment &segment, size_t pos, size_t size)
+{
+  uint32_t crc = crc32_init;
+  if(pos < segment.tail_pos)
   {
-    spdlog::info("{}", usage);
-    return -1;
+    const size_t mapped = std::min(size, segment.tail_pos - pos);
+    crc = crc32_update(crc, segment.mapped + pos, mapped);
+    pos += mapped;
+    size -= mapped;
+  }
+  return crc32_update(crc, image_data(segment, pos), size);
+}
+
+// Length of the next block at pos. Blocks are whole words and never
+// cross end or the copied tail
+static size_t
+next_chunk(const image_segment &segment, size_t pos, size_t end)
+{
+  if(pos < segment.tail_pos)
+    end = std::min(end, segment.tail_pos);
+  return std::min<size_t>(end - pos, bulk_block_size);
+}
+
+enum class session_state
+{
+  PROBE,       // INIT without erase sent at the probed bitrate
+  PROBE_RESET, // RESET after the target answered the probe
+  INIT,
+  ERASE,
+  PAGE_CHECK,
+  WRITE,
+  VERIFY,
+  RESET,
+  DONE,
+  FAILED
+};
+
+// Flashing of a single device, driven by the responses of its bridge
+struct flash_session
+{
+  std::string path;
+  int fd = -1;
+  session_state state = session_state::INIT;
+  std::string error;
+
+  uint32_t bitrate = default_bitrate;
+  bool bitrate_from_cache = false;
+  size_t probe = 0; // index of the probed bitrate in bitrates
+  const bitrate_speed *negotiated = nullptr;
+
+  // blocks are acknowledged cumulatively by sequence number
+  uint32_t blocks_sent = 0;
+  uint32_t blocks_acked = 0;
+  size_t segment = 0;   // index of the segment being flashed
+  size_t done = 0;      // bytes of the finished segments
+  size_t pos = 0;       // segment offset of the next block
+  size_t block_end = 0; // blocks are sent up to here, a page in the differential mode
+  size_t skipped_bytes = 0;
+  uint32_t changed_pages = 0;
+  uint32_t unchanged_pages = 0;
+  uint32_t compressed_blocks = 0;
+  size_t compressed_saved = 0; // bytes the compressed blocks were shorter
+
+  // crc of the block data in the order it is sent, the bridge
+  // calculates the same over the written ones
+  uint32_t image_crc = crc32_init;
+
+  // region checked by the pending VERIFY
+  size_t verify_segment = 0;
+  size_t verify_pos = 0;
+  size_t verify_size = 0;
+  uint32_t verified_regions = 0;
+
+  // bytes read from the device which don't form a complete packet yet
+  std::array<uint8_t, rx_buffer_size> rx;
+  size_t rx_len = 0;
+
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+static bool
+session_active(const flash_session &session)
+{
+  return session.state != session_state::DONE && session.state != session_state::FAILED;
+}
+
+static void
+session_fail(flash_session &session, const std::string &error)
+{
+  spdlog::error("[FLASHER] {}: {}", session.path, error);
+  session.error = error;
+  session.state = session_state::FAILED;
+  session.end = std::chrono::steady_clock::now();
+}
+
+// Every request sent to the bridge has to be answered before the deadline
+static void
+session_expect_response(flash_session &session,
+                        std::chrono::steady_clock::duration timeout = response_timeout)
+{
+  session.deadline = std::chrono::steady_clock::now() + timeout;
+}
+
+// INIT and ERASE are answered once the target is erased, the bridge
+// allows the erase its own budget on top of the usual answer time
+static std::chrono::steady_clock::duration
+erase_timeout(flash_erase_type erase_type, uint32_t size, uint32_t page_size)
+{
+  switch(erase_type)
+  {
+    case flash_erase_type::MASS:
+      return response_timeout + std::chrono::milliseconds(flash_mass_erase_timeout_ms);
+    case flash_erase_type::PAGES:
+      return response_timeout + std::chrono::milliseconds((size + page_size - 1) / page_size *
+                                                          flash_page_erase_timeout_ms);
+    default:
+      return response_timeout;
   }
+}
+
+// Drops everything received so far, used to resynchronize with the bridge
+static void
+session_flush_rx(flash_session &session)
+{
+  tcflush(session.fd, TCIFLUSH);
+  session.rx_len = 0;
+}
+
+static uint32_t
+session_addr(const flash_session &session, const flash_image &image)
+{
+  return image.segments[session.segment].addr + session.pos;
+}
+
+static void
+session_next_segment(flash_session &session, const flash_image &image)
+{
+  session.done += image.segments[session.segment].size;
+  session.segment++;
+  session.pos = 0;
+  session.block_end = 0;
+}
 
-  if(argc == 4)
+// INIT erases the pages of the first segment, the others are erased by ERASE
+static void
+session_send_init(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  const image_segment &first = image.segments.front();
+  session.image_crc = crc32_init;
+  if(!send_init_packet(session.fd, config.erase_type, first.addr, first.size, config.page_size,
+                       config.verbosity))
   {
-    if(strcmp(argv[3], "info") == 0)
-    {
-      spdlog::set_level(spdlog::level::info);
-    }else if(strcmp(argv[3], "debug") == 0)
-    {
-      spdlog::set_level(spdlog::level::debug);
-      disable_proggress = true;
-    }else if(strcmp(argv[3], "trace") == 0)
-    {
-      spdlog::set_level(spdlog::level::trace);
-      disable_proggress = true;
-    }else{
-      spdlog::error("Invalid logging category level");
-      spdlog::info("{}", usage);
-      return -1;
-    }
+    session_fail(session, "Sending init packet failed");
+    return;
   }
+  session.state = session_state::INIT;
+  session_expect_response(session, erase_timeout(config.erase_type, first.size, config.page_size));
+}
+
+// INIT without erase makes the bootloader detect the bitrate and answer
+// the GET command, RESET brings the target back to its application
+static void
+session_send_probe(flash_session &session, const flash_config &config)
+{
+  const auto &rate = bitrates[session.probe];
+  spdlog::info("[FLASHER] {}: Probing bitrate {}", session.path, rate.bitrate);
 
-  device = open(argv[1], O_RDWR);
-  if(device == -1)
+  if(!set_device_params(session.fd, rate.speed) ||
+     !send_init_packet(session.fd, flash_erase_type::NONE, start_flash_addr, 0, default_page_size,
+                       config.verbosity))
   {
-    spdlog::error("[FLASHER] Can't open device");
-    return -2;
+    session_fail(session, "Sending probe failed");
+    return;
   }
-  std::thread(receive_msg, device).detach();
+  session.state = session_state::PROBE;
+  session_expect_response(session);
+}
 
-  if(!set_device_params(device))
+// Settles on the highest bitrate the target answered at and starts the flashing
+static void
+session_finish_negotiation(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  if(session.negotiated == nullptr)
   {
-    spdlog::error("[FLASHER] Setting device params, failed");
-    return -3;
+    session_fail(session, fmt::format("Target doesn't answer at {} bitrate", default_bitrate));
+    return;
   }
 
-  binary = open(argv[2], O_RDONLY);
-  if (binary == -1)
+  // an answer to the failed probe must not be taken for the INIT response
+  session_flush_rx(session);
+  if(session.negotiated != &bitrates[session.probe] &&
+     !set_device_params(session.fd, session.negotiated->speed))
   {
-    spdlog::error("[FLASHER] Can't open file.");
-    return -2;
+    session_fail(session, "Setting device params failed");
+    return;
   }
 
-  stat(argv[2], &st);
-  file_size = st.st_size;
-  spdlog::info("[FLASHER] Flashing binary {} of size {}", argv[2], file_size);
+  session.bitrate = session.negotiated->bitrate;
+  store_cached_bitrate(session.path, session.bitrate);
+  spdlog::info("[FLASHER] {}: Negotiated bitrate {}", session.path, session.bitrate);
+  session_send_init(session, config, image);
+}
+
+static void
+session_start(flash_session &session, const flash_config &config, const flash_image &image,
+              const std::map<std::string, uint32_t> &bitrate_cache)
+{
+  session.start = std::chrono::steady_clock::now();
 
-  // init packet
-  if(!send_init_packet(device))
+  session.fd = open(session.path.c_str(), O_RDWR | O_NONBLOCK);
+  if(session.fd == -1)
   {
-    spdlog::error("[FLASHER] Sending init packet fail");
-    finish = true;
-    return -1;
+    session_fail(session, "Can't open device");
+    return;
   }
 
-  if(!wait_for_response())
+  if(config.negotiate)
   {
-    spdlog::error("[FLASHER] Waiting for init response failed");
-    finish = true;
-    return -1;
+    session.probe = std::find_if(bitrates.begin(), bitrates.end(),
+                                 [](const bitrate_speed &b) { return b.bitrate == default_bitrate; }) -
+                    bitrates.begin();
+    session_send_probe(session, config);
+    return;
+  }
+
+  session.bitrate = config.bitrate;
+  if(session.bitrate == 0)
+  {
+    auto cached = bitrate_cache.find(session.path);
+    session.bitrate_from_cache = cached != bitrate_cache.end();
+    session.bitrate = session.bitrate_from_cache ? cached->second : default_bitrate;
+  }
+
+  if(!set_device_params(session.fd, *bitrate_to_speed(session.bitrate)))
+  {
+    session_fail(session, "Setting device params failed");
+    return;
+  }
+  session_send_init(session, config, image);
+}
+
+// Checks the next region of the written image with VERIFY when
+// verification is enabled, finishes with RESET when all are done
+static void
+session_finish(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  if(config.verify && session.verify_segment < image.segments.size())
+  {
+    const image_segment &segment = image.segments[session.verify_segment];
+    session.verify_size = std::min(segment.size - session.verify_pos, verify_region_size);
+    if(!send_verify_packet(session.fd, segment.addr + session.verify_pos, session.verify_size))
+    {
+      session_fail(session, "Sending verify packet failed");
+      return;
+    }
+    session.state = session_state::VERIFY;
+    session_expect_response(session);
+    return;
   }
-  next_read = max_payload; 
-  while(total_bytes_read < file_size)
+
+  if(!send_reset_packet(session.fd))
   {
-    bytes_read = read(binary, file_buf + to_send, next_read);
-    spdlog::trace("[FLASHER] Read bytes {}", bytes_read);
-    to_send += bytes_read;
+    session_fail(session, "Sending reset packet failed");
+    return;
+  }
+  session.state = session_state::RESET;
+  session_expect_response(session);
+}
 
-    if(bytes_read == 0)
+// Sends the blocks up to block_end while the window allows it,
+// checks the next page in the differential mode, erases the next segment
+// when the pages are erased selectively and finishes with RESET
+static void
+session_pump(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  while(session.state == session_state::WRITE)
+  {
+    const image_segment &segment = image.segments[session.segment];
+    if(session.pos == session.block_end)
     {
-      // we can get here only when the payload size is not alligned to 4
-      if(to_send != 0)
+      const bool segment_done = session.pos == segment.size;
+      const bool image_done = segment_done && session.segment + 1 == image.segments.size();
+      if(segment_done && !image_done && config.erase_type != flash_erase_type::PAGES)
+      {
+        session_next_segment(session, image);
+        continue;
+      }
+
+      if(segment_done || config.erase_type == flash_erase_type::NONE)
       {
-        while(to_send & 0b11){
-          file_buf[to_send] = 0x0;
-          to_send++;
+        // RESET, ERASE, VERIFY and the page check response have to come after the ACKs of all blocks
+        if(session.blocks_acked != session.blocks_sent)
+          return;
+
+        if(image_done)
+        {
+          session_finish(session, config, image);
+          return;
         }
-        if(!send_frame_with_correct_endian(device, flash_address, file_buf, to_send))
+        else if(segment_done)
         {
-          spdlog::error("[FLASHER] Sending frame packet failed");
-          finish = true;
-          return -4;
+          const image_segment &next = image.segments[session.segment + 1];
+          if(!send_erase_packet(session.fd, next.addr, next.size, config.page_size))
+          {
+            session_fail(session, "Sending erase packet failed");
+            return;
+          }
+          session.state = session_state::ERASE;
+          session_expect_response(session, erase_timeout(flash_erase_type::PAGES, next.size, config.page_size));
         }
-
-        if(!wait_for_response())
+        else
         {
-          spdlog::error("[FLASHER] Waiting for frame packet response failed");
-          finish = true;
-          return -1;
+          if(!send_page_check(session.fd, session_addr(session, image), image_data(segment, session.pos),
+                              config.page_size))
+          {
+            session_fail(session, "Sending page check packet failed");
+            return;
+          }
+          session.state = session_state::PAGE_CHECK;
+          session_expect_response(session, erase_timeout(flash_erase_type::PAGES, config.page_size,
+                                                         config.page_size));
         }
+        return;
       }
-      break;
+      session.block_end = segment.size;
     }
 
-    if(bytes_read < 0)
+    if(session.blocks_sent - session.blocks_acked >= config.block_window)
+      return;
+
+    const size_t chunk = next_chunk(segment, session.pos, session.block_end);
+    const uint8_t *data = image_data(segment, session.pos);
+    size_t payload_offset = 0;
+    const size_t payload_size = trim_erased(data, chunk, payload_offset);
+    session.skipped_bytes += chunk - payload_size;
+
+    if(payload_size != 0)
     {
-      spdlog::error("[FLASHER] Data read general error {}", errno);
-      if(!send_reset_packet(device))
+      const uint32_t addr = session_addr(session, image) + payload_offset;
+      uint8_t stream[bulk_block_size];
+      const auto stream_size = config.compress ? compress_block(data + payload_offset, payload_size, stream)
+                                               : std::nullopt;
+      if(stream_size.has_value())
       {
-        spdlog::error("[FLASHER] Sending reset packet failed");
-        finish = true;
-        return -4;
+        if(!send_compressed_write(session.fd, addr, session.blocks_sent, payload_size, stream, *stream_size))
+        {
+          session_fail(session, "Sending compressed write packet failed");
+          return;
+        }
+        session.compressed_blocks++;
+        session.compressed_saved += payload_size - *stream_size;
       }
-      if(!wait_for_response())
+      else if(!send_bulk_write(session.fd, addr, session.blocks_sent, data + payload_offset, payload_size))
       {
-        spdlog::error("[FLASHER] Waiting for reset packet response failed\n");
-        finish = true;
-        return -1;
+        session_fail(session, "Sending bulk write packet failed");
+        return;
       }
-      return -2;
+      if(session.blocks_sent == session.blocks_acked)
+        session_expect_response(session);
+      session.blocks_sent++;
+      session.image_crc = crc32_update(session.image_crc, data + payload_offset, payload_size);
     }
+    session.pos += chunk;
+  }
+}
+
+static void
+session_on_response(flash_session &session, const bridge_response &rsp,
+                    const flash_config &config, const flash_image &image)
+{
+  switch(session.state)
+  {
+    case session_state::PROBE:
+      if(rsp.type != flash_response_type::ACK)
+      {
+        session_finish_negotiation(session, config, image);
+        return;
+      }
+      if(!send_reset_packet(session.fd))
+      {
+        session_fail(session, "Sending reset packet failed");
+        return;
+      }
+      session.state = session_state::PROBE_RESET;
+      session_expect_response(session);
+      break;
 
-   flash_address = start_flash_addr + total_bytes_read;
-   total_bytes_read += bytes_read;
+    case session_state::PROBE_RESET:
+      if(rsp.type == flash_response_type::ACK)
+        session.negotiated = &bitrates[session.probe];
+      if(rsp.type != flash_response_type::ACK || session.probe + 1 == bitrates.size())
+      {
+        session_finish_negotiation(session, config, image);
+        return;
+      }
+      session.probe++;
+      session_send_probe(session, config);
+      break;
 
-    if(bytes_read & 0b11) {
-      next_read = next_read - bytes_read;
-      continue;
-    }
-    else
-      next_read = max_payload;
-
-   if(!send_frame_with_correct_endian(device, flash_address, file_buf, to_send))
-   {
-     spdlog::error("[FLASHER] Sending frame packet failed");
-     return  -4;
-   }
-
-   spdlog::trace("[FLASHER] Waiting for response...");
-   if(!wait_for_response())
-   {
-     spdlog::error("[FLASHER] Waiting for frame packet response failed");
-     finish = true;
-     return -1;
-   }
-   if(!disable_proggress)
-   {
-     const uint8_t progress = static_cast<uint8_t>(total_bytes_read/static_cast<double>(file_size)*100);
-     const uint8_t bar_percent = static_cast<uint8_t>(total_bytes_read/static_cast<double>(file_size)*25);
-     std::fill_n(progress_bar.begin(), bar_percent, '#');
-     printf("Progress[%25s] [%d%]\r", progress_bar.data(), progress);
-     fflush(stdout);
-   }
-   to_send = 0;
-  }
-
-  if(!send_reset_packet(device))
-  {
-    spdlog::error("[FLASHER] Sending reset packet failed");
-    finish = true;
-    return -4;
-  }
-
-  if(!wait_for_response())
-  {
-    spdlog::error("[FLASHER] Waiting for reset packet response failed");
-    finish = true;
-    return -1;
-  }
+    case session_state::INIT:
+      if(rsp.type == flash_response_type::ACK)
+      {
+        session.state = session_state::WRITE;
+        session_pump(session, config, image);
+        return;
+      }
+
+      if(session.bitrate_from_cache && session.bitrate != default_bitrate)
+      {
+        spdlog::warn("[FLASHER] {}: Init at cached bitrate {} failed, retrying at {}",
+                     session.path, session.bitrate, default_bitrate);
+        session.bitrate_from_cache = false;
+        session.bitrate = default_bitrate;
+        if(!set_device_params(session.fd, *bitrate_to_speed(default_bitrate)))
+        {
+          session_fail(session, "Setting device params failed");
+          return;
+        }
+        session_send_init(session, config, image);
+        return;
+      }
+      session_fail(session, "Init failed");
+      break;
+
+    case session_state::ERASE:
+      if(rsp.type != flash_response_type::ACK)
+      {
+        session_fail(session, fmt::format("Erasing segment {:#x} failed",
+                                          image.segments[session.segment + 1].addr));
+        return;
+      }
+      session_next_segment(session, image);
+      session.state = session_state::WRITE;
+      session_pump(session, config, image);
+      break;
+
+    case session_state::PAGE_CHECK:
+      spdlog::debug("[FLASHER] {}: Page {:#x} {}", session.path, session_addr(session, image),
+                    rsp.type == flash_response_type::PAGE_MATCH ? "unchanged" : "erased");
+      if(rsp.type == flash_response_type::PAGE_MATCH)
+      {
+        session.unchanged_pages++;
+        session.pos += config.page_size;
+        session.block_end = session.pos;
+      }
+      else if(rsp.type == flash_response_type::PAGE_ERASED)
+      {
+        session.changed_pages++;
+        session.block_end = session.pos + config.page_size;
+      }
+      else
+      {
+        session_fail(session, fmt::format("Checking page {:#x} failed", session_addr(session, image)));
+        return;
+      }
+      session.state = session_state::WRITE;
+      session_pump(session, config, image);
+      break;
+
+    case session_state::WRITE:
+      {
+        if(rsp.type != flash_response_type::ACK)
+        {
+          session_fail(session, fmt::format("Block with seq {} rejected", rsp.seq));
+          return;
+        }
+
+        const uint8_t delta = static_cast<uint8_t>(rsp.seq - static_cast<uint8_t>(session.blocks_acked));
+        if(delta >= session.blocks_sent - session.blocks_acked)
+        {
+          session_fail(session, fmt::format("Unexpected ACK for seq {}", rsp.seq));
+          return;
+        }
+        session.blocks_acked += delta + 1;
+        if(session.blocks_acked != session.blocks_sent)
+          session_expect_response(session);
+        session_pump(session, config, image);
+      }
+      break;
+
+    case session_state::VERIFY:
+      {
+        const image_segment &segment = image.segments[session.verify_segment];
+        const uint32_t addr = segment.addr + session.verify_pos;
+        const uint32_t expected = segment_crc(segment, session.verify_pos, session.verify_size);
+        if(rsp.type != flash_response_type::ACK || !rsp.crc.has_value())
+        {
+          session_fail(session, fmt::format("Verifying {:#x} failed", addr));
+          return;
+        }
+        if(rsp.crc.value() != expected)
+        {
+          session_fail(session, fmt::format("Verification of {:#x} size {} failed, crc {:#010x} != {:#010x}",
+                                            addr, session.verify_size, rsp.crc.value(), expected));
+          return;
+        }
+
+        spdlog::debug("[FLASHER] {}: Region {:#x} size {} verified", session.path, addr, session.verify_size);
+        session.verified_regions++;
+        session.verify_pos += session.verify_size;
+        if(session.verify_pos == segment.size)
+        {
+          session.verify_segment++;
+          session.verify_pos = 0;
+        }
+        session_finish(session, config, image);
+      }
+      break;
+
+    case session_state::RESET:
+      // the bridge resets the target anyway, NACK means a staged write failed
+      if(rsp.type != flash_response_type::ACK)
+      {
+        session_fail(session, "Writing the image failed, target was reset");
+        return;
+      }
+      // the bridge reports crc of all the payloads it has written
+      if(rsp.crc.has_value() && rsp.crc.value() != session.image_crc)
+      {
+        session_fail(session, fmt::format("Image crc mismatch {:#010x} != {:#010x}",
+                                          rsp.crc.value(), session.image_crc));
+        return;
+      }
+      if(!rsp.crc.has_value())
+        spdlog::warn("[FLASHER] {}: Bridge doesn't report the image crc", session.path);
+      session.state = session_state::DONE;
+      session.end = std::chrono::steady_clock::now();
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void
+session_on_timeout(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  if(session.state == session_state::PROBE || session.state == session_state::PROBE_RESET)
+  {
+    session_finish_negotiation(session, config, image);
+    return;
+  }
+  session_fail(session, fmt::format("Timeout while waiting for the bridge, block {}", session.blocks_acked));
+}
+
+// Returns the length of the packet at the beginning of buf, nullopt when
+// more bytes are needed to tell it. A corrupt length byte is returned as
+// it is, below flash_msg_header_length
+static std::optional<size_t>
+bridge_packet_length(const uint8_t *buf, size_t size)
+{
+  if(size < flash_msg_header_length)
+    return std::nullopt;
+
+  // MSG length byte can't hold the full size, the payload size is used instead
+  if(buf[common_type_pos] == static_cast<uint8_t>(packet_type::MSG))
+    return flash_msg_header_length + buf[flash_msg_payload_size_pos];
+  return buf[common_length_pos];
+}
+
+// texts of the bridge messages, the bridge sends only their ids
+struct log_message
+{
+  flash_log_level level;
+  const char *text;
+};
+
+constexpr log_message log_messages[] = {
+#define FLASH_LOG_TEXT(id, level, text) {flash_log_level::level, text},
+  FLASH_LOG_MESSAGES(FLASH_LOG_TEXT)
+#undef FLASH_LOG_TEXT
+};
+static_assert(std::size(log_messages) == static_cast<size_t>(log_id::COUNT));
+
+// Formats a LOG packet as printf would format the text of its id,
+// the arguments are 32 bit values so only integer conversions are handled
+static std::string
+format_log(const flash_log &log)
+{
+  if(log.get_id() >= std::size(log_messages))
+    return fmt::format("Unknown message {}", log.get_id());
+
+  std::string text;
+  uint8_t arg = 0;
+  for(const char *c = log_messages[log.get_id()].text; *c != '\0'; c++)
+  {
+    if(*c != '%' || c[1] == '\0')
+    {
+      text += *c;
+      continue;
+    }
+
+    c++;
+    if(*c == '%')
+    {
+      text += '%';
+      continue;
+    }
+
+    const uint32_t value = arg < log.get_arg_count() ? log.get_arg(arg++) : 0;
+    switch(*c)
+    {
+      case 'd':
+      case 'i':
+        text += std::to_string(static_cast<int32_t>(value));
+        break;
+      case 'u':
+        text += std::to_string(value);
+        break;
+      case 'x':
+        text += fmt::format("{:x}", value);
+        break;
+      case 'X':
+        text += fmt::format("{:X}", value);
+        break;
+      case 'c':
+        text += static_cast<char>(value);
+        break;
+      default:
+        text += '%';
+        text += *c;
+        break;
+    }
+  }
+  return text;
+}
+
+static void
+session_handle_packet(flash_session &session, uint8_t *buf, size_t length,
+                      const flash_config &config, const flash_image &image)
+{
+  raw_packet packet(buf, length);
+
+  switch(buf[common_type_pos])
+  {
+    case (uint8_t)packet_type::RESPONSE:
+      {
+        auto flash_response_packet_opt = flash_response::make_flash_response(packet);
+        if(!flash_response_packet_opt.has_value())
+          break;
+
+        auto flash_response_packet = flash_response_packet_opt.value();
+        spdlog::debug("[STM32 RESPONSE] {}: {} seq {}", session.path,
+                      flash_response_packet.get_response() == flash_response_type::ACK ? "ACK" : "NACK",
+                      flash_response_packet.get_seq());
+        session_on_response(session,
+                            {flash_response_packet.get_response(), flash_response_packet.get_seq(),
+                             flash_response_packet.get_crc()},
+                            config, image);
+        return;
+      }
+
+    case (uint8_t)packet_type::MSG:
+      {
+        auto flash_msg_packet_opt = flash_msg::make_flash_msg(packet);
+        if(!flash_msg_packet_opt.has_value())
+          break;
+
+        auto flash_msg_packet = flash_msg_packet_opt.value();
+        spdlog::debug("[STM32 MSG] {}: {}", session.path,
+                      reinterpret_cast<const char*>(flash_msg_packet.get_msg()));
+        return;
+      }
+
+    case (uint8_t)packet_type::LOG:
+      {
+        auto flash_log_packet_opt = flash_log::make_flash_log(packet);
+        if(!flash_log_packet_opt.has_value())
+          break;
+
+        // failures are sent at any verbosity, they are shown without debug_level too
+        auto flash_log_packet = flash_log_packet_opt.value();
+        const bool failure = flash_log_packet.get_id() < std::size(log_messages) &&
+                             log_messages[flash_log_packet.get_id()].level == flash_log_level::ERROR;
+        spdlog::log(failure ? spdlog::level::warn : spdlog::level::debug,
+                    "[STM32 MSG] {}: {}", session.path, format_log(flash_log_packet));
+        return;
+      }
+    default:
+      break;
+  }
+
+  spdlog::error("[FLASHER] {}: Incorrect frame {} {}", session.path, buf[0], buf[1]);
+  session_flush_rx(session);
+}
+
+// Pulls everything the tty has in a single read and handles
+// all the complete packets, the rest waits for the next read
+static void
+session_receive(flash_session &session, const flash_config &config, const flash_image &image)
+{
+  const ssize_t bytes_read = read(session.fd, session.rx.data() + session.rx_len,
+                                  session.rx.size() - session.rx_len);
+  if(bytes_read < 0)
+  {
+    if(errno != EAGAIN && errno != EINTR)
+      session_fail(session, fmt::format("Reading device failed, err={}", errno));
+    return;
+  }
+  // called only when poll reported data, nothing to read means the device is gone
+  if(bytes_read == 0 && session.rx_len < session.rx.size())
+  {
+    session_fail(session, "Device hung up");
+    return;
+  }
+  session.rx_len += bytes_read;
+
+  size_t pos = 0;
+  while(session_active(session) && session.rx_len > pos)
+  {
+    uint8_t *buf = session.rx.data() + pos;
+    const auto length_opt = bridge_packet_length(buf, session.rx_len - pos);
+    if(!length_opt.has_value())
+      break;
+
+    const size_t length = *length_opt;
+    if(length < flash_msg_header_length)
+    {
+      spdlog::error("[FLASHER] {}: Incorrect frame length {}", session.path, length);
+      session_flush_rx(session);
+      return;
+    }
+    if(length > session.rx_len - pos)
+      break;
+
+    pos += length;
+
+    const size_t rx_len = session.rx_len;
+    session_handle_packet(session, buf, length, config, image);
+    // the buffer was dropped to resynchronize
+    if(session.rx_len != rx_len)
+      return;
+  }
+
+  std::memmove(session.rx.data(), session.rx.data() + pos, session.rx_len - pos);
+  session.rx_len -= pos;
+}
+
+static bool
+map_file(const char *path, flash_image &image)
+{
+  const int binary = open(path, O_RDONLY);
+  if(binary == -1)
+  {
+    spdlog::error("[FLASHER] Can't open file.");
+    return false;
+  }
+
+  struct stat st;
+  if(fstat(binary, &st) == -1)
+  {
+    spdlog::error("[FLASHER] Can't stat file {}", errno);
+    close(binary);
+    return false;
+  }
+  image.file_size = st.st_size;
+
+  if(image.file_size != 0)
+  {
+    void *mapped = mmap(nullptr, image.file_size, PROT_READ, MAP_PRIVATE, binary, 0);
+    if(mapped == MAP_FAILED)
+    {
+      spdlog::error("[FLASHER] Mapping file failed {}", errno);
+      close(binary);
+      return false;
+    }
+    madvise(mapped, image.file_size, MADV_SEQUENTIAL);
+    image.file = static_cast<const uint8_t*>(mapped);
+  }
+  close(binary);
+  return true;
+}
+
+// Loads the data of PT_LOAD segments, they are flashed at their physical
+// (load) address, .bss and other segments without file data are skipped
+static bool
+parse_elf(const flash_image &image, std::vector<image_range> &ranges)
+{
+  Elf32_Ehdr ehdr;
+  if(image.file_size < sizeof(ehdr))
+  {
+    spdlog::error("[FLASHER] ELF header truncated");
+    return false;
+  }
+  std::memcpy(&ehdr, image.file, sizeof(ehdr));
+
+  if(ehdr.e_ident[EI_CLASS] != ELFCLASS32 || ehdr.e_ident[EI_DATA] != ELFDATA2LSB)
+  {
+    spdlog::error("[FLASHER] Only 32 bit little endian ELF files are supported");
+    return false;
+  }
+
+  if(ehdr.e_phentsize != sizeof(Elf32_Phdr) ||
+     ehdr.e_phoff + static_cast<uint64_t>(ehdr.e_phnum) * sizeof(Elf32_Phdr) > image.file_size)
+  {
+    spdlog::error("[FLASHER] ELF program headers are incorrect");
+    return false;
+  }
+
+  for(size_t i = 0; i < ehdr.e_phnum; i++)
+  {
+    Elf32_Phdr phdr;
+    std::memcpy(&phdr, image.file + ehdr.e_phoff + i * sizeof(phdr), sizeof(phdr));
+    if(phdr.p_type != PT_LOAD || phdr.p_filesz == 0)
+      continue;
+
+    if(phdr.p_offset + static_cast<uint64_t>(phdr.p_filesz) > image.file_size)
+    {
+      spdlog::error("[FLASHER] ELF segment {} exceeds the file", i);
+      return false;
+    }
+    spdlog::debug("[FLASHER] ELF segment {:#x} size {}", phdr.p_paddr, phdr.p_filesz);
+    ranges.push_back({phdr.p_paddr, image.file + phdr.p_offset, phdr.p_filesz});
+  }
+  return true;
+}
+
+static std::optional<uint8_t>
+parse_hex_byte(const uint8_t *text)
+{
+  uint8_t byte = 0;
+  for(int i = 0; i < 2; i++)
+  {
+    const uint8_t c = text[i];
+    byte <<= 4;
+    if(c >= '0' && c <= '9')
+      byte |= c - '0';
+    else if(c >= 'a' && c <= 'f')
+      byte |= c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F')
+      byte |= c - 'A' + 10;
+    else
+      return std::nullopt;
+  }
+  return byte;
+}
+
+// Loads the data records of Intel HEX, consecutive records are joined
+// in hex_data. Extended segment and linear address records move the base
+static bool
+parse_hex(flash_image &image, std::vector<image_range> &ranges)
+{
+  enum hex_record : uint8_t
+  {
+    DATA = 0x00,
+    END_OF_FILE = 0x01,
+    EXTENDED_SEGMENT_ADDRESS = 0x02,
+    START_SEGMENT_ADDRESS = 0x03,
+    EXTENDED_LINEAR_ADDRESS = 0x04,
+    START_LINEAR_ADDRESS = 0x05
+  };
+
+  std::vector<uint32_t> starts;
+  uint32_t base = 0;
+  size_t line = 0;
+  const uint8_t *text = image.file;
+  const uint8_t *text_end = image.file + image.file_size;
+
+  while(text != text_end)
+  {
+    const uint8_t *line_end = std::find(text, text_end, '\n');
+    const uint8_t *record = text;
+    text = line_end == text_end ? text_end : line_end + 1;
+    line++;
+
+    while(line_end != record && (line_end[-1] == '\r' || line_end[-1] == ' '))
+      line_end--;
+    if(record == line_end)
+      continue;
+
+    // length, address (2), type, data and checksum
+    uint8_t bytes[4 + 255 + 1];
+    size_t count = 0;
+    const size_t digits = line_end - record - 1;
+    if(*record != ':' || digits % 2 != 0 || digits / 2 > sizeof(bytes) || digits / 2 < 5)
+    {
+      spdlog::error("[FLASHER] Incorrect HEX record in line {}", line);
+      return false;
+    }
+    for(const uint8_t *c = record + 1; c != line_end; c += 2)
+    {
+      auto byte = parse_hex_byte(c);
+      if(!byte.has_value())
+      {
+        spdlog::error("[FLASHER] Incorrect HEX digit in line {}", line);
+        return false;
+      }
+      bytes[count++] = *byte;
+    }
+
+    uint8_t sum = 0;
+    for(size_t i = 0; i < count; i++)
+      sum += bytes[i];
+    if(count != bytes[0] + 5u || sum != 0)
+    {
+      spdlog::error("[FLASHER] HEX record length or checksum mismatch in line {}", line);
+      return false;
+    }
+
+    const uint8_t *data = bytes + 4;
+    const uint8_t data_size = bytes[0];
+    const uint32_t offset = bytes[1] << 8 | bytes[2];
+    switch(bytes[3])
+    {
+      case DATA:
+        {
+          if(data_size == 0)
+            break;
+          const uint32_t addr = base + offset;
+          if(image.hex_data.empty() || starts.back() + image.hex_data.back().size() != addr)
+          {
+            starts.push_back(addr);
+            image.hex_data.emplace_back();
+          }
+          image.hex_data.back().insert(image.hex_data.back().end(), data, data + data_size);
+        }
+        break;
+      case END_OF_FILE:
+        text = text_end;
+        break;
+      case EXTENDED_SEGMENT_ADDRESS:
+      case EXTENDED_LINEAR_ADDRESS:
+        if(data_size != 2)
+        {
+          spdlog::error("[FLASHER] Incorrect HEX address record in line {}", line);
+          return false;
+        }
+        base = (data[0] << 8 | data[1]) << (bytes[3] == EXTENDED_LINEAR_ADDRESS ? 16 : 4);
+        break;
+      case START_SEGMENT_ADDRESS:
+      case START_LINEAR_ADDRESS:
+        break;
+      default:
+        spdlog::error("[FLASHER] Unknown HEX record type {} in line {}", bytes[3], line);
+        return false;
+    }
+  }
+
+  for(size_t i = 0; i < starts.size(); i++)
+    ranges.push_back({starts[i], image.hex_data[i].data(), image.hex_data[i].size()});
+  return true;
+}
+
+// Groups the ranges into the segments. Ranges which share an erase unit
+// (a page, or a word with mass erase) are joined, otherwise erasing the
+// later one would destroy the former, the gap is filled with 0xff and
+// never sent. Segments are padded to whole words, or to whole pages
+// in the differential mode, a page is compared as a whole
+static bool
+build_segments(flash_image &image, std::vector<image_range> ranges, const flash_config &config)
+{
+  const uint64_t align = config.erase_type == flash_erase_type::NONE ? config.page_size : 4;
+  const uint64_t unit = config.erase_type == flash_erase_type::MASS ? 4 : config.page_size;
+
+  std::sort(ranges.begin(), ranges.end(),
+            [](const image_range &a, const image_range &b) { return a.addr < b.addr; });
+
+  for(size_t i = 0; i < ranges.size(); i++)
+  {
+    const uint64_t end = ranges[i].addr + static_cast<uint64_t>(ranges[i].size);
+    if(end > (uint64_t{1} << 32) || (i + 1 < ranges.size() && ranges[i + 1].addr < end))
+    {
+      spdlog::error("[FLASHER] Data at {:#x} overlaps or exceeds the address space", ranges[i].addr);
+      return false;
+    }
+  }
+
+  for(size_t first = 0; first < ranges.size();)
+  {
+    size_t last = first;
+    uint64_t end = ranges[first].addr + static_cast<uint64_t>(ranges[first].size);
+    while(last + 1 < ranges.size() && ranges[last + 1].addr / unit <= (end - 1) / unit)
+    {
+      last++;
+      end = ranges[last].addr + static_cast<uint64_t>(ranges[last].size);
+    }
+
+    image_segment segment;
+    const uint64_t begin = ranges[first].addr / align * align;
+    segment.addr = begin;
+    segment.size = (end + align - 1) / align * align - begin;
+
+    if(first == last && begin == ranges[first].addr)
+    {
+      segment.mapped = ranges[first].data;
+      segment.tail_pos = ranges[first].size / align * align;
+      segment.tail.assign(segment.size - segment.tail_pos, 0xff);
+      std::copy(ranges[first].data + segment.tail_pos, ranges[first].data + ranges[first].size,
+                segment.tail.begin());
+    }
+    else
+    {
+      segment.tail.assign(segment.size, 0xff);
+      for(size_t i = first; i <= last; i++)
+        std::copy_n(ranges[i].data, ranges[i].size, segment.tail.begin() + (ranges[i].addr - begin));
+    }
+
+    spdlog::debug("[FLASHER] Segment {:#x} size {}", segment.addr, segment.size);
+    image.padded_size += segment.size;
+    image.segments.push_back(std::move(segment));
+    first = last + 1;
+  }
+  return true;
+}
+
+// The binary is flashed from start_flash_addr, ELF and Intel HEX files
+// carry the addresses of their data which may leave gaps
+static bool
+load_image(const char *path, const flash_config &config, flash_image &image)
+{
+  if(!map_file(path, image))
+    return false;
+
+  const std::string extension = std::filesystem::path(path).extension();
+  std::vector<image_range> ranges;
+  bool loaded = true;
+  if(image.file_size >= SELFMAG && std::equal(image.file, image.file + SELFMAG, ELFMAG))
+    loaded = parse_elf(image, ranges);
+  else if(extension == ".hex" || extension == ".ihex")
+    loaded = parse_hex(image, ranges);
+  else if(image.file_size != 0)
+    ranges.push_back({start_flash_addr, image.file, image.file_size});
+
+  if(!loaded || !build_segments(image, ranges, config))
+    return false;
+
+  for(const auto &range : ranges)
+    image.size += range.size;
+
+  if(image.segments.empty())
+  {
+    spdlog::error("[FLASHER] Nothing to flash in {}", path);
+    return false;
+  }
+  return true;
+}
+
+static void
+unload_image(flash_image &image)
+{
+  if(image.file != nullptr)
+    munmap(const_cast<uint8_t*>(image.file), image.file_size);
+  image.file = nullptr;
+}
+
+static void
+print_progress(const std::vector<flash_session> &sessions, const flash_image &image)
+{
+  constexpr size_t progres_bar_width = 25;
+  size_t done = 0;
+  for(const auto &session : sessions)
+    done += session.state == session_state::DONE ? image.padded_size : session.done + session.pos;
+
+  const double ratio = image.padded_size == 0 ? 1.0 : done / static_cast<double>(image.padded_size * sessions.size());
+  std::string progress_bar(progres_bar_width, ' ');
+  std::fill_n(progress_bar.begin(), static_cast<size_t>(ratio * progres_bar_width), '#');
+  printf("Progress[%s] [%d%%]\r", progress_bar.c_str(), static_cast<int>(ratio * 100));
+  fflush(stdout);
+}
+
+static void
+print_summary(const std::vector<flash_session> &sessions, const flash_config &config, const char *binary)
+{
+  spdlog::info("[FLASHER] Summary for {} on {} device(s)", binary, sessions.size());
+  for(const auto &session : sessions)
+  {
+    const std::chrono::duration<double> elapsed = session.end - session.start;
+    const std::string result = session.state == session_state::DONE ? "OK" : "FAILED (" + session.error + ")";
+    spdlog::info("[FLASHER] {}: {} in {:.2f}s, bitrate {}, blocks {} with crc {:#010x}, skipped {} erased (0xff) bytes",
+                 session.path, result, elapsed.count(), session.bitrate,
+                 session.blocks_sent, session.image_crc, session.skipped_bytes);
+    if(config.erase_type == flash_erase_type::NONE)
+      spdlog::info("[FLASHER] {}: Pages rewritten {}, unchanged {}",
+                   session.path, session.changed_pages, session.unchanged_pages);
+    if(config.compress)
+      spdlog::info("[FLASHER] {}: Blocks compressed {}, saved {} bytes",
+                   session.path, session.compressed_blocks, session.compressed_saved);
+    if(config.verify)
+      spdlog::info("[FLASHER] {}: Regions verified {}", session.path, session.verified_regions);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  flash_config config;
+  flash_image image;
+  bool disable_proggress = false;
+
+  int opt;
+  const option long_options[] = {
+    {"verify", no_argument, nullptr, 'v'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  while((opt = getopt_long(argc, argv, "w:p:mdb:Bvn", long_options, nullptr)) != -1)
+  {
+    switch(opt)
+    {
+      case 'w':
+        config.block_window = strtoul(optarg, nullptr, 10);
+        if(config.block_window < 1 || config.block_window > max_block_window)
+        {
+          spdlog::error("Invalid block window {}", optarg);
+          spdlog::info("{}", usage);
+          return -1;
+        }
+        break;
+      case 'p':
+        config.page_size = strtoul(optarg, nullptr, 10);
+        if(config.page_size < min_page_size || config.page_size > UINT16_MAX ||
+           (config.page_size & (config.page_size - 1)) != 0)
+        {
+          spdlog::error("Invalid page size {}", optarg);
+          spdlog::info("{}", usage);
+          return -1;
+        }
+        break;
+      case 'm':
+        config.erase_type = flash_erase_type::MASS;
+        break;
+      case 'd':
+        config.erase_type = flash_erase_type::NONE;
+        break;
+      case 'b':
+        config.bitrate = strtoul(optarg, nullptr, 10);
+        if(!bitrate_to_speed(config.bitrate).has_value())
+        {
+          spdlog::error("Unsupported bitrate {}", optarg);
+          spdlog::info("{}", usage);
+          return -1;
+        }
+        break;
+      case 'B':
+        config.negotiate = true;
+        break;
+      case 'v':
+        config.verify = true;
+        break;
+      case 'n':
+        config.compress = false;
+        break;
+      default:
+        spdlog::info("{}", usage);
+        return -1;
+    }
+  }
+
+  std::vector<std::string> args(argv + optind, argv + argc);
+
+  if(args.size() >= 3)
+  {
+    const std::string &level = args.back();
+    if(level == "info")
+    {
+      spdlog::set_level(spdlog::level::info);
+      args.pop_back();
+    }else if(level == "debug")
+    {
+      spdlog::set_level(spdlog::level::debug);
+      config.verbosity = flash_log_level::INFO;
+      disable_proggress = true;
+      args.pop_back();
+    }else if(level == "trace")
+    {
+      spdlog::set_level(spdlog::level::trace);
+      config.verbosity = flash_log_level::TRACE;
+      disable_proggress = true;
+      args.pop_back();
+    }
+  }
+
+  if(args.size() < 2)
+  {
+    spdlog::info("{}", usage);
+    return -1;
+  }
+
+  const std::string binary = args.back();
+  args.pop_back();
+
+  if(!load_image(binary.c_str(), config, image))
+    return -2;
+  spdlog::info("[FLASHER] Flashing binary {} of size {} in {} segment(s) on {} device(s)",
+               binary, image.size, image.segments.size(), args.size());
+
+  std::vector<flash_session> sessions(args.size());
+  const auto bitrate_cache = load_bitrate_cache();
+  for(size_t i = 0; i < args.size(); i++)
+  {
+    sessions[i].path = args[i];
+    session_start(sessions[i], config, image, bitrate_cache);
+  }
+
+  // all the bridges are driven by their responses from a single loop,
+  // which sleeps until data arrives or the nearest deadline passes
+  std::vector<pollfd> fds;
+  std::vector<flash_session*> polled;
+  auto last_progress = std::chrono::steady_clock::now();
+  while(std::any_of(sessions.begin(), sessions.end(), session_active))
+  {
+    fds.clear();
+    polled.clear();
+    auto next_deadline = std::chrono::steady_clock::time_point::max();
+    for(auto &session : sessions)
+    {
+      if(!session_active(session))
+        continue;
+      fds.push_back({session.fd, POLLIN, 0});
+      polled.push_back(&session);
+      next_deadline = std::min(next_deadline, session.deadline);
+    }
+
+    auto timeout = std::chrono::ceil<std::chrono::milliseconds>(next_deadline - std::chrono::steady_clock::now());
+    if(!disable_proggress)
+      timeout = std::min<std::chrono::milliseconds>(timeout, progress_interval);
+    if(poll(fds.data(), fds.size(), std::max<int>(timeout.count(), 0)) < 0 && errno != EINTR)
+    {
+      spdlog::error("[FLASHER] Poll failed, err={}", errno);
+      return -1;
+    }
+
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+      flash_session &session = *polled[i];
+      if(fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+      {
+        session_fail(session, "Device disconnected");
+        continue;
+      }
+      if(fds[i].revents & POLLIN)
+        session_receive(session, config, image);
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    for(auto *session : polled)
+      if(session_active(*session) && now >= session->deadline)
+        session_on_timeout(*session, config, image);
+
+    if(!disable_proggress && now - last_progress >= progress_interval)
+    {
+      print_progress(sessions, image);
+      last_progress = now;
+    }
+  }
+  if(!disable_proggress)
+    printf("\n");
+
+  print_summary(sessions, config, binary.c_str());
+
+  for(auto &session : sessions)
+    if(session.fd != -1)
+      close(session.fd);
+  unload_image(image);
 
-  spdlog::info("[FLASHER] Job Completed. Binary {} with size {} flashed", argv[2], file_size);
-  finish = true;
-  close(device);
+  const bool all_done = std::all_of(sessions.begin(), sessions.end(),
+                                    [](const flash_session &s) { return s.state == session_state::DONE; });
+  if(all_done)
+    spdlog::info("[FLASHER] Job Completed. Binary {} with size {} flashed", binary, image.size);
+  return all_done ? 0 : -1;
 }
@@ -21,6 +21,8 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 /* USER CODE BEGIN Includes */
+extern DMA_HandleTypeDef hdma_uartx_rx;
+extern DMA_HandleTypeDef hdma_uartx_tx;
 
 /* USER CODE END Includes */
 
@@ -76,7 +78,8 @@ void HAL_MspInit(void)
   __HAL_AFIO_REMAP_SWJ_DISABLE();
 
   /* USER CODE BEGIN MspInit 1 */
-
+  /* the CRC unit calculates crc of the flashed image */
+  __HAL_RCC_CRC_CLK_ENABLE();
   /* USER CODE END MspInit 1 */
 }
 
@@ -112,6 +115,48 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     GPIO_InitStruct.Pull = GPIO_NOPULL;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+    /* USART1 DMA Init */
+    /* USART1_RX Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_uartx_rx.Instance = DMA1_Channel5;
+    hdma_uartx_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_uartx_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_uartx_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_uartx_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_uartx_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_uartx_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_uartx_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_uartx_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(huart,hdmarx,hdma_uartx_rx);
+
+    /* DMA1_Channel5_IRQn interrupt configuration */
+    HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+    /* USART1_TX Init */
+    hdma_uartx_tx.Instance = DMA1_Channel4;
+    hdma_uartx_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_uartx_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_uartx_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_uartx_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_uartx_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_uartx_tx.Init.Mode = DMA_NORMAL;
+    hdma_uartx_tx.Init.Priority = DMA_PRIORITY_MEDIUM;
+    if (HAL_DMA_Init(&hdma_uartx_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(huart,hdmatx,hdma_uartx_tx);
+
+    /* DMA1_Channel4_IRQn interrupt configuration */
+    HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+
     /* USART1 interrupt Init */
     HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(USART1_IRQn);
@@ -144,6 +189,12 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     */
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_9|GPIO_PIN_10);
 
+    /* USART1 DMA DeInit */
+    HAL_DMA_DeInit(huart->hdmarx);
+    HAL_DMA_DeInit(huart->hdmatx);
+    HAL_NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+    HAL_NVIC_DisableIRQ(DMA1_Channel4_IRQn);
+
     /* USART1 interrupt DeInit */
     HAL_NVIC_DisableIRQ(USART1_IRQn);
   /* USER CODE BEGIN USART1_MspDeInit 1 */
@@ -21,6 +21,7 @@
 #include "usb_device.h"
 /* [COPY ME] */
 #include "config.h"
+#include "usbd_cdc_if.h"
 /* [END COPY ME] */
 
 void SystemClock_Config(void);
@@ -36,13 +37,11 @@ int main(void)
   while (1)
   {
       /* [COPY ME] */
-      // TODO need to reassemble the packet when its size is
-      // greater than 64 Bytes
-      if(usb_event_rx)
-      {
-        handle_command(usb_rx.buf, usb_rx.len);
-        usb_event_rx = 0;
-      }
+      struct usb_data *usb_packet = usb_rx_peek();
+      // a packet which has to wait for the running command stays in its slot
+      if(usb_packet && handle_command(usb_packet->buf, usb_packet->len))
+        CDC_Release_Rx_FS();
+      flasher_poll();
       /* [END COPY ME] */
   }
 }
@@ -0,0 +1,71 @@
+#include "proto.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_BULK_DATA_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_BULK_DATA_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_BULK_DATA_PAYLOAD_POS  = 2;
+
+constexpr size_t  FLASH_BULK_DATA_HEADER_SIZE  = 2;
+constexpr size_t  FLASH_BULK_DATA_MAX_SIZE     = 255;
+constexpr size_t  FLASH_BULK_DATA_MAX_PAYLOAD  = 252;
+constexpr uint8_t FLASH_BULK_DATA_TYPE         = 0x0a;
+
+} // namespace
+
+TEST(FlashBulkDataTest, build_header_and_make_flash_bulk_data_success)
+{
+ usb_byte_t buffer[FLASH_BULK_DATA_MAX_SIZE];
+ const uint8_t data[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+
+ raw_packet header(buffer, FLASH_BULK_DATA_MAX_SIZE);
+
+ auto flash_bulk_data_builder_opt = flash_bulk_data_builder::make_flash_bulk_data_header_builder(header);
+
+ ASSERT_TRUE(flash_bulk_data_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_BULK_DATA_LENGTH_POS], usb_byte_t{ FLASH_BULK_DATA_HEADER_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_BULK_DATA_TYPE_POS], usb_byte_t{ FLASH_BULK_DATA_TYPE });
+
+ auto flash_bulk_data_builder = *flash_bulk_data_builder_opt;
+
+ EXPECT_FALSE(flash_bulk_data_builder.set_data_view(0));
+ EXPECT_FALSE(flash_bulk_data_builder.set_data_view(6));
+ EXPECT_FALSE(flash_bulk_data_builder.set_data_view(FLASH_BULK_DATA_MAX_PAYLOAD + 1));
+ ASSERT_TRUE(flash_bulk_data_builder.set_data_view(sizeof(data)));
+ EXPECT_EQ(buffer[COMMON_FLASH_BULK_DATA_LENGTH_POS], usb_byte_t{ FLASH_BULK_DATA_HEADER_SIZE + sizeof(data) });
+
+ // only the header belongs to the built packet, the data is sent after it
+ flash_bulk_data flash_bulk_data_header(flash_bulk_data_builder);
+ EXPECT_EQ(flash_bulk_data_header.cdata(), buffer);
+
+ std::copy_n(data, sizeof(data), buffer + FLASH_BULK_DATA_PAYLOAD_POS);
+
+ auto made_bulk_data = flash_bulk_data::make_flash_bulk_data(raw_packet(buffer, FLASH_BULK_DATA_MAX_SIZE));
+ ASSERT_TRUE(made_bulk_data.has_value());
+ EXPECT_EQ(uint8_t(made_bulk_data->get_type().value()), FLASH_BULK_DATA_TYPE);
+ EXPECT_EQ(made_bulk_data->size(), FLASH_BULK_DATA_HEADER_SIZE + sizeof(data));
+ EXPECT_EQ(made_bulk_data->end(), buffer + FLASH_BULK_DATA_HEADER_SIZE + sizeof(data));
+ EXPECT_EQ(made_bulk_data->get_data_size(), sizeof(data));
+ EXPECT_EQ(made_bulk_data->get_data(), buffer + FLASH_BULK_DATA_PAYLOAD_POS);
+ EXPECT_EQ(made_bulk_data->get_data()[7], usb_byte_t{ 0x08 });
+}
+
+TEST(FlashBulkDataTest, make_flash_bulk_data_incorrect)
+{
+ usb_byte_t buffer[FLASH_BULK_DATA_MAX_SIZE] = { FLASH_BULK_DATA_HEADER_SIZE, FLASH_BULK_DATA_TYPE };
+
+ // without data
+ EXPECT_FALSE(flash_bulk_data::make_flash_bulk_data(raw_packet(buffer, FLASH_BULK_DATA_MAX_SIZE)).has_value());
+
+ // data not in words
+ buffer[COMMON_FLASH_BULK_DATA_LENGTH_POS] = FLASH_BULK_DATA_HEADER_SIZE + 3;
+ EXPECT_FALSE(flash_bulk_data::make_flash_bulk_data(raw_packet(buffer, FLASH_BULK_DATA_MAX_SIZE)).has_value());
+
+ // longer than the buffer
+ buffer[COMMON_FLASH_BULK_DATA_LENGTH_POS] = FLASH_BULK_DATA_HEADER_SIZE + 8;
+ EXPECT_FALSE(flash_bulk_data::make_flash_bulk_data(raw_packet(buffer, FLASH_BULK_DATA_HEADER_SIZE + 4)).has_value());
+}
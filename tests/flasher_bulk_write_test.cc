@@ -0,0 +1,87 @@
+#include "proto.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_BULK_WRITE_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_BULK_WRITE_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_BULK_WRITE_SEQ_POS  = 2;
+constexpr uint8_t FLASH_BULK_WRITE_ADDR_POS = 3;
+constexpr uint8_t FLASH_BULK_WRITE_SIZE_POS = 7;
+
+constexpr size_t  FLASH_BULK_WRITE_SIZE     = 9;
+constexpr uint8_t FLASH_BULK_WRITE_TYPE     = 0x09;
+
+} // namespace
+
+TEST(FlashBulkWriteTest, build_and_make_flash_bulk_write_success)
+{
+ usb_byte_t buffer[FLASH_BULK_WRITE_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_BULK_WRITE_SIZE);
+
+ auto flash_bulk_write_builder_opt = flash_bulk_write_builder::make_flash_bulk_write_builder(raw_packet);
+
+ ASSERT_TRUE(flash_bulk_write_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_BULK_WRITE_LENGTH_POS], usb_byte_t{ FLASH_BULK_WRITE_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_BULK_WRITE_TYPE_POS], usb_byte_t{ FLASH_BULK_WRITE_TYPE });
+
+ auto flash_bulk_write_builder = *flash_bulk_write_builder_opt;
+
+ flash_bulk_write_builder.set_seq(7);
+ ASSERT_TRUE(flash_bulk_write_builder.set_block(0x08004000, 0x400));
+
+ EXPECT_EQ(buffer[FLASH_BULK_WRITE_SEQ_POS], usb_byte_t{ 7 });
+ EXPECT_EQ(buffer[FLASH_BULK_WRITE_ADDR_POS + 1], usb_byte_t{ 0x40 });
+ EXPECT_EQ(buffer[FLASH_BULK_WRITE_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_BULK_WRITE_SIZE_POS + 1], usb_byte_t{ 0x04 });
+
+ flash_bulk_write flash_bulk_write_packet(flash_bulk_write_builder);
+
+ // Pointers must be the same
+ EXPECT_EQ(flash_bulk_write_packet.cdata(), buffer);
+ EXPECT_EQ(flash_bulk_write_packet.begin(), buffer);
+ EXPECT_EQ(flash_bulk_write_packet.end(), buffer + FLASH_BULK_WRITE_SIZE);
+ EXPECT_EQ(flash_bulk_write_packet.cend(), buffer + FLASH_BULK_WRITE_SIZE);
+ EXPECT_EQ(flash_bulk_write_packet.size(), FLASH_BULK_WRITE_SIZE);
+
+ ASSERT_TRUE(flash_bulk_write_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_bulk_write_packet.get_type().value()), FLASH_BULK_WRITE_TYPE);
+
+ auto made_bulk_write = flash_bulk_write::make_flash_bulk_write(raw_packet);
+ ASSERT_TRUE(made_bulk_write.has_value());
+ EXPECT_EQ(made_bulk_write->get_seq(), 7);
+ EXPECT_EQ(made_bulk_write->get_addr(), 0x08004000u);
+ EXPECT_EQ(made_bulk_write->get_size(), 0x400u);
+}
+
+TEST(FlashBulkWriteTest, set_block_incorrect_size)
+{
+ usb_byte_t buffer[FLASH_BULK_WRITE_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_BULK_WRITE_SIZE);
+
+ auto flash_bulk_write_builder = *flash_bulk_write_builder::make_flash_bulk_write_builder(raw_packet);
+
+ EXPECT_FALSE(flash_bulk_write_builder.set_block(0x08000000, 0));
+ EXPECT_FALSE(flash_bulk_write_builder.set_block(0x08000000, 0x102));
+ EXPECT_FALSE(flash_bulk_write_builder.set_block(0x08000000, 4100));
+ EXPECT_TRUE(flash_bulk_write_builder.set_block(0x08000000, 4096));
+}
+
+TEST(FlashBulkWriteTest, make_flash_bulk_write_incorrect)
+{
+ usb_byte_t buffer[FLASH_BULK_WRITE_SIZE] = { FLASH_BULK_WRITE_SIZE, FLASH_BULK_WRITE_TYPE, 0, 0, 0, 0, 0x08, 0x02, 0 };
+
+ raw_packet raw_packet(buffer, FLASH_BULK_WRITE_SIZE);
+
+ // size has to devide by 4
+ EXPECT_FALSE(flash_bulk_write::make_flash_bulk_write(raw_packet).has_value());
+
+ buffer[FLASH_BULK_WRITE_SIZE_POS] = 0x04;
+ buffer[COMMON_FLASH_BULK_WRITE_LENGTH_POS] = 2;
+ EXPECT_FALSE(flash_bulk_write::make_flash_bulk_write(raw_packet).has_value());
+}
@@ -0,0 +1,100 @@
+#include "proto.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_COMPRESSED_WRITE_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_COMPRESSED_WRITE_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_COMPRESSED_WRITE_SEQ_POS       = 2;
+constexpr uint8_t FLASH_COMPRESSED_WRITE_ADDR_POS      = 3;
+constexpr uint8_t FLASH_COMPRESSED_WRITE_SIZE_POS      = 7;
+constexpr uint8_t FLASH_COMPRESSED_WRITE_DATA_SIZE_POS = 9;
+
+constexpr size_t  FLASH_COMPRESSED_WRITE_SIZE = 11;
+constexpr uint8_t FLASH_COMPRESSED_WRITE_TYPE = 0x0b;
+
+} // namespace
+
+TEST(FlashCompressedWriteTest, build_and_make_flash_compressed_write_success)
+{
+ usb_byte_t buffer[FLASH_COMPRESSED_WRITE_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_COMPRESSED_WRITE_SIZE);
+
+ auto flash_compressed_write_builder_opt =
+   flash_compressed_write_builder::make_flash_compressed_write_builder(raw_packet);
+
+ ASSERT_TRUE(flash_compressed_write_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_COMPRESSED_WRITE_LENGTH_POS], usb_byte_t{ FLASH_COMPRESSED_WRITE_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_COMPRESSED_WRITE_TYPE_POS], usb_byte_t{ FLASH_COMPRESSED_WRITE_TYPE });
+
+ auto flash_compressed_write_builder = *flash_compressed_write_builder_opt;
+
+ flash_compressed_write_builder.set_seq(9);
+ ASSERT_TRUE(flash_compressed_write_builder.set_block(0x08004000, 0x800, 0x124));
+
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_SEQ_POS], usb_byte_t{ 9 });
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_ADDR_POS + 1], usb_byte_t{ 0x40 });
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_SIZE_POS + 1], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_DATA_SIZE_POS], usb_byte_t{ 0x24 });
+ EXPECT_EQ(buffer[FLASH_COMPRESSED_WRITE_DATA_SIZE_POS + 1], usb_byte_t{ 0x01 });
+
+ flash_compressed_write flash_compressed_write_packet(flash_compressed_write_builder);
+
+ // Pointers must be the same
+ EXPECT_EQ(flash_compressed_write_packet.cdata(), buffer);
+ EXPECT_EQ(flash_compressed_write_packet.begin(), buffer);
+ EXPECT_EQ(flash_compressed_write_packet.end(), buffer + FLASH_COMPRESSED_WRITE_SIZE);
+ EXPECT_EQ(flash_compressed_write_packet.cend(), buffer + FLASH_COMPRESSED_WRITE_SIZE);
+ EXPECT_EQ(flash_compressed_write_packet.size(), FLASH_COMPRESSED_WRITE_SIZE);
+
+ ASSERT_TRUE(flash_compressed_write_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_compressed_write_packet.get_type().value()), FLASH_COMPRESSED_WRITE_TYPE);
+
+ auto made_compressed_write = flash_compressed_write::make_flash_compressed_write(raw_packet);
+ ASSERT_TRUE(made_compressed_write.has_value());
+ EXPECT_EQ(made_compressed_write->get_seq(), 9);
+ EXPECT_EQ(made_compressed_write->get_addr(), 0x08004000u);
+ EXPECT_EQ(made_compressed_write->get_size(), 0x800u);
+ EXPECT_EQ(made_compressed_write->get_data_size(), 0x124u);
+}
+
+TEST(FlashCompressedWriteTest, set_block_incorrect_size)
+{
+ usb_byte_t buffer[FLASH_COMPRESSED_WRITE_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_COMPRESSED_WRITE_SIZE);
+
+ auto flash_compressed_write_builder =
+   *flash_compressed_write_builder::make_flash_compressed_write_builder(raw_packet);
+
+ EXPECT_FALSE(flash_compressed_write_builder.set_block(0x08000000, 0, 4));
+ EXPECT_FALSE(flash_compressed_write_builder.set_block(0x08000000, 4100, 4));
+ // the stream has to be whole words and smaller than the block
+ EXPECT_FALSE(flash_compressed_write_builder.set_block(0x08000000, 0x100, 0));
+ EXPECT_FALSE(flash_compressed_write_builder.set_block(0x08000000, 0x100, 0x22));
+ EXPECT_FALSE(flash_compressed_write_builder.set_block(0x08000000, 0x100, 0x100));
+ EXPECT_TRUE(flash_compressed_write_builder.set_block(0x08000000, 4096, 4092));
+}
+
+TEST(FlashCompressedWriteTest, make_flash_compressed_write_incorrect)
+{
+ usb_byte_t buffer[FLASH_COMPRESSED_WRITE_SIZE] =
+   { FLASH_COMPRESSED_WRITE_SIZE, FLASH_COMPRESSED_WRITE_TYPE, 0, 0, 0, 0, 0x08, 0x00, 0x01, 0x00, 0x01 };
+
+ raw_packet raw_packet(buffer, FLASH_COMPRESSED_WRITE_SIZE);
+
+ // the stream must not be larger than the block
+ EXPECT_FALSE(flash_compressed_write::make_flash_compressed_write(raw_packet).has_value());
+
+ buffer[FLASH_COMPRESSED_WRITE_DATA_SIZE_POS] = 0x40;
+ buffer[FLASH_COMPRESSED_WRITE_DATA_SIZE_POS + 1] = 0x00;
+ EXPECT_TRUE(flash_compressed_write::make_flash_compressed_write(raw_packet).has_value());
+
+ buffer[COMMON_FLASH_COMPRESSED_WRITE_LENGTH_POS] = 9;
+ EXPECT_FALSE(flash_compressed_write::make_flash_compressed_write(raw_packet).has_value());
+}
@@ -0,0 +1,71 @@
+#include "proto.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_ERASE_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_ERASE_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_ERASE_ADDR_POS      = 2;
+constexpr uint8_t FLASH_ERASE_SIZE_POS      = 6;
+constexpr uint8_t FLASH_ERASE_PAGE_SIZE_POS = 10;
+
+constexpr size_t  FLASH_ERASE_SIZE          = 12;
+constexpr uint8_t FLASH_ERASE_TYPE          = 0x06;
+
+} // namespace
+
+TEST(FlashEraseTest, build_and_make_flash_erase_success)
+{
+ usb_byte_t buffer[FLASH_ERASE_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_ERASE_SIZE);
+
+ auto flash_erase_builder_opt = flash_erase_builder::make_flash_erase_builder(raw_packet);
+
+ ASSERT_TRUE(flash_erase_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_ERASE_LENGTH_POS], usb_byte_t{ FLASH_ERASE_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_ERASE_TYPE_POS], usb_byte_t{ FLASH_ERASE_TYPE });
+
+ auto flash_erase_builder = *flash_erase_builder_opt;
+
+ flash_erase_builder.set_range(0x08004000, 0x1234);
+ flash_erase_builder.set_page_size(0x800);
+
+ EXPECT_EQ(buffer[FLASH_ERASE_ADDR_POS + 1], usb_byte_t{ 0x40 });
+ EXPECT_EQ(buffer[FLASH_ERASE_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_ERASE_SIZE_POS], usb_byte_t{ 0x34 });
+ EXPECT_EQ(buffer[FLASH_ERASE_SIZE_POS + 1], usb_byte_t{ 0x12 });
+ EXPECT_EQ(buffer[FLASH_ERASE_PAGE_SIZE_POS + 1], usb_byte_t{ 0x08 });
+
+ flash_erase flash_erase_packet(flash_erase_builder);
+
+ // Pointers must be the same
+ EXPECT_EQ(flash_erase_packet.cdata(), buffer);
+ EXPECT_EQ(flash_erase_packet.begin(), buffer);
+ EXPECT_EQ(flash_erase_packet.end(), buffer + FLASH_ERASE_SIZE);
+ EXPECT_EQ(flash_erase_packet.cend(), buffer + FLASH_ERASE_SIZE);
+ EXPECT_EQ(flash_erase_packet.size(), FLASH_ERASE_SIZE);
+
+ ASSERT_TRUE(flash_erase_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_erase_packet.get_type().value()), FLASH_ERASE_TYPE);
+
+ EXPECT_EQ(flash_erase_packet.get_addr(), 0x08004000u);
+ EXPECT_EQ(flash_erase_packet.get_size(), 0x1234u);
+ EXPECT_EQ(flash_erase_packet.get_page_size(), 0x800u);
+
+ auto made_erase = flash_erase::make_flash_erase(raw_packet);
+ ASSERT_TRUE(made_erase.has_value());
+ EXPECT_EQ(made_erase->get_size(), 0x1234u);
+}
+
+TEST(FlashEraseTest, make_flash_erase_wrong_length)
+{
+ usb_byte_t buffer[FLASH_ERASE_SIZE] = { 2, FLASH_ERASE_TYPE };
+
+ raw_packet raw_packet(buffer, FLASH_ERASE_SIZE);
+
+ EXPECT_FALSE(flash_erase::make_flash_erase(raw_packet).has_value());
+}
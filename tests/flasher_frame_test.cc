@@ -16,10 +16,12 @@ constexpr uint8_t COMMON_FLASH_FRAME_TYPE_POS      = 1;
 constexpr uint8_t COMMON_FLASH_FRAME_ADDR_POS      = 2;
 constexpr uint8_t COMMON_FLASH_FRAME_DATA_SIZE_POS = 6;
 constexpr uint8_t COMMON_FLASH_FRAME_CHKSUM_POS    = 7;
-constexpr uint8_t COMMON_FLASH_FRAME_DATA_POS      = 8;
+constexpr uint8_t COMMON_FLASH_FRAME_SEQ_POS       = 8;
+constexpr uint8_t COMMON_FLASH_FRAME_DATA_POS      = 9;
 
 constexpr uint8_t FLASH_FRAME_TYPE          = 0x01;
-constexpr uint8_t FLASH_FRAME_HEADER_SIZE   = 0x08;
+constexpr uint8_t FLASH_FRAME_HEADER_SIZE   = 0x09;
+constexpr uint8_t FLASH_FRAME_SEQ           = 0xa5;
 
 constexpr uint32_t FLASH_INIT_FLASH_ADDRESS= 0x80121056;
 
@@ -46,6 +48,7 @@ TEST(FlashFrameTest, build_and_make_flash_frame_success)
   auto flash_frame_builder = *flash_frame_builder_opt;
 
   flash_frame_builder.set_flash_addr(FLASH_INIT_FLASH_ADDRESS);
+  flash_frame_builder.set_seq(FLASH_FRAME_SEQ);
   EXPECT_FALSE(flash_frame_builder.set_data(FLASH_FRAME_DATA, 0x5));
   EXPECT_TRUE(flash_frame_builder.set_data(FLASH_FRAME_DATA, 0x4));
  
@@ -74,6 +77,10 @@ TEST(FlashFrameTest, build_and_make_flash_frame_success)
             usb_byte_t{ FLASH_FRAME_TYPE });
 
   EXPECT_EQ(flash_frame_packet.get_checksum(), EXPECTED_PAYLOAD_CHECKSUM);
+  EXPECT_EQ(flash_frame_packet.get_seq(), FLASH_FRAME_SEQ);
+  EXPECT_EQ(flash_frame_packet.data()[COMMON_FLASH_FRAME_SEQ_POS],
+            usb_byte_t{ FLASH_FRAME_SEQ });
+  EXPECT_EQ(flash_frame_packet.get_payload(), buffer + COMMON_FLASH_FRAME_DATA_POS);
   
   for(int i =0 ;i <flash_frame_packet.get_payload_size(); i++)
   {
@@ -81,3 +88,42 @@ TEST(FlashFrameTest, build_and_make_flash_frame_success)
   }
 
 }
+
+TEST(FlashFrameTest, build_flash_frame_header_with_data_view)
+{
+  constexpr uint8_t FLASH_FRAME_DATA_SIZE = 8;
+  constexpr uint8_t FLASH_FRAME_DATA[FLASH_FRAME_DATA_SIZE] = {0x10, 0xa, 0xff, 0x00, 0xbb, 0x01, 0x02, 0x03};
+  usb_byte_t header[FLASH_FRAME_HEADER_SIZE];
+  usb_byte_t buffer[FLASH_FRAME_HEADER_SIZE + FLASH_FRAME_DATA_SIZE];
+
+  auto header_builder_opt =
+    flash_frame_builder::make_flash_frame_header_builder(raw_packet(header, FLASH_FRAME_HEADER_SIZE));
+  auto frame_builder_opt =
+    flash_frame_builder::make_flash_frame_builder(raw_packet(buffer, sizeof(buffer)));
+
+  ASSERT_TRUE(header_builder_opt.has_value());
+  ASSERT_TRUE(frame_builder_opt.has_value());
+
+  auto header_builder = *header_builder_opt;
+  auto frame_builder = *frame_builder_opt;
+
+  header_builder.set_flash_addr(FLASH_INIT_FLASH_ADDRESS);
+  header_builder.set_seq(FLASH_FRAME_SEQ);
+  EXPECT_FALSE(header_builder.set_data_view(FLASH_FRAME_DATA, 0x5));
+  EXPECT_FALSE(header_builder.set_data_view(FLASH_FRAME_DATA, 0x0));
+  EXPECT_TRUE(header_builder.set_data_view(FLASH_FRAME_DATA, FLASH_FRAME_DATA_SIZE));
+
+  frame_builder.set_flash_addr(FLASH_INIT_FLASH_ADDRESS);
+  frame_builder.set_seq(FLASH_FRAME_SEQ);
+  EXPECT_TRUE(frame_builder.set_data(FLASH_FRAME_DATA, FLASH_FRAME_DATA_SIZE));
+
+  // The header followed by the payload must match the copied frame
+  for(int i = 0; i < FLASH_FRAME_HEADER_SIZE; i++)
+  {
+    EXPECT_EQ(header[i], buffer[i]) << i;
+  }
+
+  EXPECT_EQ(header[COMMON_FLASH_FRAME_LENGTH_POS],
+            usb_byte_t{ FLASH_FRAME_HEADER_SIZE + FLASH_FRAME_DATA_SIZE });
+  EXPECT_EQ(header[COMMON_FLASH_FRAME_DATA_SIZE_POS], usb_byte_t{ FLASH_FRAME_DATA_SIZE });
+}
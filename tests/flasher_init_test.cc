@@ -8,8 +8,16 @@ namespace
 constexpr uint8_t COMMON_FLASH_INIT_LENGTH_POS = 0;
 constexpr uint8_t COMMON_FLASH_INIT_TYPE_POS   = 1;
 
-constexpr size_t  FLASH_INIT_SIZE          = 2;
+constexpr uint8_t FLASH_INIT_ERASE_TYPE_POS = 2;
+constexpr uint8_t FLASH_INIT_ADDR_POS       = 3;
+constexpr uint8_t FLASH_INIT_IMAGE_SIZE_POS = 7;
+constexpr uint8_t FLASH_INIT_PAGE_SIZE_POS  = 11;
+constexpr uint8_t FLASH_INIT_VERBOSITY_POS  = 13;
+
+constexpr size_t  FLASH_INIT_SIZE          = 14;
 constexpr uint8_t FLASH_INIT_TYPE          = 0x00;
+constexpr uint8_t FLASH_INIT_ERASE_MASS    = 0x00;
+constexpr uint8_t FLASH_INIT_ERASE_PAGES   = 0x01;
 
 } // namespace
 
@@ -25,8 +33,25 @@ TEST(FlashInitTest, build_and_make_flash_init_success)
  EXPECT_EQ(buffer[COMMON_FLASH_INIT_LENGTH_POS], usb_byte_t{ FLASH_INIT_SIZE });
  EXPECT_EQ(buffer[COMMON_FLASH_INIT_TYPE_POS], usb_byte_t{ FLASH_INIT_TYPE });
 
+ EXPECT_EQ(buffer[FLASH_INIT_ERASE_TYPE_POS], usb_byte_t{ FLASH_INIT_ERASE_MASS });
+ EXPECT_EQ(buffer[FLASH_INIT_VERBOSITY_POS], static_cast<uint8_t>(flash_log_level::ERROR));
+
  auto flash_init_builder = *flash_init_builder_opt;
 
+ flash_init_builder.set_erase_type(flash_erase_type::PAGES);
+ flash_init_builder.set_image_range(0x08000400, 0x1234);
+ flash_init_builder.set_page_size(0x400);
+ flash_init_builder.set_verbosity(flash_log_level::TRACE);
+
+ EXPECT_EQ(buffer[FLASH_INIT_ERASE_TYPE_POS], usb_byte_t{ FLASH_INIT_ERASE_PAGES });
+ EXPECT_EQ(buffer[FLASH_INIT_ADDR_POS], usb_byte_t{ 0x00 });
+ EXPECT_EQ(buffer[FLASH_INIT_ADDR_POS + 1], usb_byte_t{ 0x04 });
+ EXPECT_EQ(buffer[FLASH_INIT_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_INIT_IMAGE_SIZE_POS], usb_byte_t{ 0x34 });
+ EXPECT_EQ(buffer[FLASH_INIT_IMAGE_SIZE_POS + 1], usb_byte_t{ 0x12 });
+ EXPECT_EQ(buffer[FLASH_INIT_PAGE_SIZE_POS + 1], usb_byte_t{ 0x04 });
+ EXPECT_EQ(buffer[FLASH_INIT_VERBOSITY_POS], static_cast<uint8_t>(flash_log_level::TRACE));
+
  flash_init flash_init_packet(flash_init_builder);
 
  // Pointers must be the same
@@ -47,4 +72,14 @@ TEST(FlashInitTest, build_and_make_flash_init_success)
  EXPECT_EQ(uint8_t(flash_init_packet.get_type().value()), FLASH_INIT_TYPE);
  EXPECT_EQ(flash_init_packet.data()[COMMON_FLASH_INIT_TYPE_POS],
            usb_byte_t{ FLASH_INIT_TYPE });
+
+ EXPECT_EQ(flash_init_packet.get_erase_type(), flash_erase_type::PAGES);
+ EXPECT_EQ(flash_init_packet.get_image_addr(), 0x08000400u);
+ EXPECT_EQ(flash_init_packet.get_image_size(), 0x1234u);
+ EXPECT_EQ(flash_init_packet.get_page_size(), 0x400u);
+ EXPECT_EQ(flash_init_packet.get_verbosity(), flash_log_level::TRACE);
+
+ auto made_init = flash_init::make_flash_init(raw_packet);
+ ASSERT_TRUE(made_init.has_value());
+ EXPECT_EQ(made_init->get_image_size(), 0x1234u);
 }
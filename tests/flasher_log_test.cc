@@ -0,0 +1,93 @@
+#include "proto.hpp"
+#include "log.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_LOG_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_LOG_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_LOG_ID_POS        = 2;
+constexpr uint8_t FLASH_LOG_ARG_COUNT_POS = 3;
+constexpr uint8_t FLASH_LOG_ARGS_POS      = 4;
+
+constexpr size_t  FLASH_LOG_HEADER_SIZE   = 4;
+constexpr size_t  FLASH_LOG_MAX_SIZE      = 20;
+constexpr uint8_t FLASH_LOG_TYPE          = 0x08;
+
+} // namespace
+
+TEST(FlashLogTest, build_and_make_flash_log_success)
+{
+ usb_byte_t buffer[FLASH_LOG_MAX_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_LOG_MAX_SIZE);
+
+ auto flash_log_builder_opt = flash_log_builder::make_flash_log_builder(raw_packet);
+
+ ASSERT_TRUE(flash_log_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_LOG_LENGTH_POS], usb_byte_t{ FLASH_LOG_HEADER_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_LOG_TYPE_POS], usb_byte_t{ FLASH_LOG_TYPE });
+
+ auto flash_log_builder = *flash_log_builder_opt;
+
+ flash_log_builder.set_id(static_cast<uint8_t>(log_id::FRAME_OUT_OF_ORDER));
+ EXPECT_TRUE(flash_log_builder.add_arg(0x12));
+ EXPECT_TRUE(flash_log_builder.add_arg(0xdeadbeef));
+
+ EXPECT_EQ(buffer[COMMON_FLASH_LOG_LENGTH_POS], usb_byte_t{ FLASH_LOG_HEADER_SIZE + 8 });
+ EXPECT_EQ(buffer[FLASH_LOG_ID_POS], static_cast<uint8_t>(log_id::FRAME_OUT_OF_ORDER));
+ EXPECT_EQ(buffer[FLASH_LOG_ARG_COUNT_POS], usb_byte_t{ 2 });
+ EXPECT_EQ(buffer[FLASH_LOG_ARGS_POS], usb_byte_t{ 0x12 });
+ EXPECT_EQ(buffer[FLASH_LOG_ARGS_POS + 7], usb_byte_t{ 0xde });
+
+ flash_log flash_log_packet(flash_log_builder);
+
+ EXPECT_EQ(flash_log_packet.cdata(), buffer);
+ EXPECT_EQ(flash_log_packet.size(), FLASH_LOG_HEADER_SIZE + 8);
+ EXPECT_EQ(flash_log_packet.end(), buffer + FLASH_LOG_HEADER_SIZE + 8);
+
+ ASSERT_TRUE(flash_log_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_log_packet.get_type().value()), FLASH_LOG_TYPE);
+
+ EXPECT_EQ(flash_log_packet.get_id(), static_cast<uint8_t>(log_id::FRAME_OUT_OF_ORDER));
+ EXPECT_EQ(flash_log_packet.get_arg_count(), 2);
+ EXPECT_EQ(flash_log_packet.get_arg(0), 0x12u);
+ EXPECT_EQ(flash_log_packet.get_arg(1), 0xdeadbeefu);
+
+ auto made_log = flash_log::make_flash_log(raw_packet);
+ ASSERT_TRUE(made_log.has_value());
+ EXPECT_EQ(made_log->get_arg(1), 0xdeadbeefu);
+}
+
+TEST(FlashLogTest, flash_log_args_limit)
+{
+ usb_byte_t buffer[FLASH_LOG_MAX_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_LOG_MAX_SIZE);
+
+ auto flash_log_builder = *flash_log_builder::make_flash_log_builder(raw_packet);
+
+ for(uint32_t i = 0; i < 4; i++)
+   EXPECT_TRUE(flash_log_builder.add_arg(i));
+ EXPECT_FALSE(flash_log_builder.add_arg(4));
+ EXPECT_EQ(buffer[COMMON_FLASH_LOG_LENGTH_POS], usb_byte_t{ FLASH_LOG_MAX_SIZE });
+
+ auto small_builder = *flash_log_builder::make_flash_log_builder(::raw_packet(buffer, FLASH_LOG_HEADER_SIZE));
+ EXPECT_FALSE(small_builder.add_arg(0));
+}
+
+TEST(FlashLogTest, make_flash_log_wrong_length)
+{
+ usb_byte_t buffer[FLASH_LOG_MAX_SIZE] = { FLASH_LOG_HEADER_SIZE, FLASH_LOG_TYPE, 0, 1 };
+
+ raw_packet raw_packet(buffer, FLASH_LOG_MAX_SIZE);
+
+ EXPECT_FALSE(flash_log::make_flash_log(raw_packet).has_value());
+
+ buffer[FLASH_LOG_ARG_COUNT_POS] = 5;
+ buffer[COMMON_FLASH_LOG_LENGTH_POS] = FLASH_LOG_HEADER_SIZE + 20;
+ EXPECT_FALSE(flash_log::make_flash_log(raw_packet).has_value());
+}
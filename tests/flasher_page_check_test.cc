@@ -0,0 +1,92 @@
+#include "proto.hpp"
+#include "crc.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_PAGE_CHECK_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_PAGE_CHECK_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_PAGE_CHECK_ADDR_POS      = 2;
+constexpr uint8_t FLASH_PAGE_CHECK_PAGE_SIZE_POS = 6;
+constexpr uint8_t FLASH_PAGE_CHECK_CRC_POS       = 8;
+
+constexpr size_t  FLASH_PAGE_CHECK_SIZE          = 12;
+constexpr uint8_t FLASH_PAGE_CHECK_TYPE          = 0x05;
+
+} // namespace
+
+TEST(FlashPageCheckTest, build_and_make_flash_page_check_success)
+{
+ usb_byte_t buffer[FLASH_PAGE_CHECK_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_PAGE_CHECK_SIZE);
+
+ auto flash_page_check_builder_opt = flash_page_check_builder::make_flash_page_check_builder(raw_packet);
+
+ ASSERT_TRUE(flash_page_check_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_PAGE_CHECK_LENGTH_POS], usb_byte_t{ FLASH_PAGE_CHECK_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_PAGE_CHECK_TYPE_POS], usb_byte_t{ FLASH_PAGE_CHECK_TYPE });
+
+ auto flash_page_check_builder = *flash_page_check_builder_opt;
+
+ flash_page_check_builder.set_page_addr(0x08000800);
+ flash_page_check_builder.set_page_size(0x400);
+ flash_page_check_builder.set_crc(0xdf8a8a2b);
+
+ EXPECT_EQ(buffer[FLASH_PAGE_CHECK_ADDR_POS + 1], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_PAGE_CHECK_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_PAGE_CHECK_PAGE_SIZE_POS + 1], usb_byte_t{ 0x04 });
+ EXPECT_EQ(buffer[FLASH_PAGE_CHECK_CRC_POS], usb_byte_t{ 0x2b });
+ EXPECT_EQ(buffer[FLASH_PAGE_CHECK_CRC_POS + 3], usb_byte_t{ 0xdf });
+
+ flash_page_check flash_page_check_packet(flash_page_check_builder);
+
+ // Pointers must be the same
+ EXPECT_EQ(flash_page_check_packet.cdata(), buffer);
+ EXPECT_EQ(flash_page_check_packet.data(), buffer);
+ EXPECT_EQ(flash_page_check_packet.begin(), buffer);
+ EXPECT_EQ(flash_page_check_packet.cbegin(), buffer);
+ EXPECT_EQ(flash_page_check_packet.end(), buffer + FLASH_PAGE_CHECK_SIZE);
+ EXPECT_EQ(flash_page_check_packet.cend(), buffer + FLASH_PAGE_CHECK_SIZE);
+
+ EXPECT_EQ(flash_page_check_packet.size(), FLASH_PAGE_CHECK_SIZE);
+
+ ASSERT_TRUE(flash_page_check_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_page_check_packet.get_type().value()), FLASH_PAGE_CHECK_TYPE);
+
+ EXPECT_EQ(flash_page_check_packet.get_page_addr(), 0x08000800u);
+ EXPECT_EQ(flash_page_check_packet.get_page_size(), 0x400u);
+ EXPECT_EQ(flash_page_check_packet.get_crc(), 0xdf8a8a2bu);
+
+ auto made_page_check = flash_page_check::make_flash_page_check(raw_packet);
+ ASSERT_TRUE(made_page_check.has_value());
+ EXPECT_EQ(made_page_check->get_crc(), 0xdf8a8a2bu);
+}
+
+TEST(FlashPageCheckTest, make_flash_page_check_wrong_length)
+{
+ usb_byte_t buffer[FLASH_PAGE_CHECK_SIZE] = { 2, FLASH_PAGE_CHECK_TYPE };
+
+ raw_packet raw_packet(buffer, FLASH_PAGE_CHECK_SIZE);
+
+ EXPECT_FALSE(flash_page_check::make_flash_page_check(raw_packet).has_value());
+}
+
+TEST(FlashPageCheckTest, crc_matches_stm32_crc_unit)
+{
+ // the word 0x12345678 written to CRC->DR after reset gives 0xdf8a8a2b
+ const uint8_t word[] = { 0x78, 0x56, 0x34, 0x12 };
+ EXPECT_EQ(crc32_update(crc32_init, word, sizeof(word)), 0xdf8a8a2bu);
+
+ uint8_t data[16];
+ for (uint8_t i = 0; i < sizeof(data); i++)
+   data[i] = i;
+
+ // the crc can be calculated in parts
+ const uint32_t crc = crc32_update(crc32_init, data, sizeof(data));
+ EXPECT_EQ(crc, 0x081b46cau);
+ EXPECT_EQ(crc32_update(crc32_update(crc32_init, data, 8), data + 8, 8), crc);
+}
@@ -8,9 +8,11 @@ namespace
 constexpr uint8_t COMMON_FLASH_RESPONSE_LENGTH_POS = 0;
 constexpr uint8_t COMMON_FLASH_RESPONSE_TYPE_POS   = 1;
 constexpr uint8_t FLASH_RESPONSE_TYPE_POS   = 2;
+constexpr uint8_t FLASH_RESPONSE_SEQ_POS    = 3;
 
-constexpr size_t  FLASH_RESPONSE_SIZE          = 3;
+constexpr size_t  FLASH_RESPONSE_SIZE          = 4;
 constexpr uint8_t FLASH_RESPONSE_TYPE          = 0x03;
+constexpr uint8_t FLASH_RESPONSE_SEQ           = 0x7e;
 
 
 } // namespace
@@ -52,6 +54,7 @@ TEST(FlashresponseTest, build_and_make_flash_response_ack_success)
            usb_byte_t{ FLASH_RESPONSE_TYPE });
 
  EXPECT_EQ(flash_response_packet.get_response(), flash_response_type::ACK);
+ EXPECT_EQ(flash_response_packet.get_seq(), 0);
 }
 
 TEST(FlashresponseTest, build_and_make_flash_response_nack_success)
@@ -68,6 +71,7 @@ TEST(FlashresponseTest, build_and_make_flash_response_nack_success)
 
  auto flash_response_builder = *flash_response_builder_opt;
  flash_response_builder.set_response(flash_response_type::NACK);
+ flash_response_builder.set_seq(FLASH_RESPONSE_SEQ);
 
  flash_response flash_response_packet(flash_response_builder);
 
@@ -91,4 +95,59 @@ TEST(FlashresponseTest, build_and_make_flash_response_nack_success)
            usb_byte_t{ FLASH_RESPONSE_TYPE });
 
  EXPECT_EQ(flash_response_packet.get_response(), flash_response_type::NACK);
+ EXPECT_EQ(flash_response_packet.get_seq(), FLASH_RESPONSE_SEQ);
+ EXPECT_EQ(flash_response_packet.data()[FLASH_RESPONSE_SEQ_POS],
+           usb_byte_t{ FLASH_RESPONSE_SEQ });
+}
+
+TEST(FlashresponseTest, build_and_make_flash_response_with_crc_success)
+{
+  constexpr size_t FLASH_RESPONSE_CRC_SIZE = 8;
+  constexpr uint8_t FLASH_RESPONSE_CRC_POS = 4;
+  usb_byte_t buffer[FLASH_RESPONSE_CRC_SIZE];
+
+  raw_packet raw_packet(buffer, FLASH_RESPONSE_CRC_SIZE);
+
+ auto flash_response_builder_opt = flash_response_builder::make_flash_response_builder(raw_packet);
+
+ ASSERT_TRUE(flash_response_builder_opt.has_value());
+
+ auto flash_response_builder = *flash_response_builder_opt;
+ flash_response_builder.set_response(flash_response_type::ACK);
+ EXPECT_TRUE(flash_response_builder.set_crc(0xdf8a8a2b));
+
+ EXPECT_EQ(buffer[COMMON_FLASH_RESPONSE_LENGTH_POS], usb_byte_t{ FLASH_RESPONSE_CRC_SIZE });
+ EXPECT_EQ(buffer[FLASH_RESPONSE_CRC_POS], usb_byte_t{ 0x2b });
+ EXPECT_EQ(buffer[FLASH_RESPONSE_CRC_POS + 3], usb_byte_t{ 0xdf });
+
+ flash_response flash_response_packet(flash_response_builder);
+
+ EXPECT_EQ(flash_response_packet.size(), FLASH_RESPONSE_CRC_SIZE);
+ EXPECT_EQ(flash_response_packet.end(), buffer + FLASH_RESPONSE_CRC_SIZE);
+ EXPECT_EQ(flash_response_packet.get_response(), flash_response_type::ACK);
+ ASSERT_TRUE(flash_response_packet.get_crc().has_value());
+ EXPECT_EQ(flash_response_packet.get_crc().value(), 0xdf8a8a2bu);
+
+ auto made_response = flash_response::make_flash_response(raw_packet);
+ ASSERT_TRUE(made_response.has_value());
+ EXPECT_EQ(made_response->get_crc(), 0xdf8a8a2bu);
+}
+
+TEST(FlashresponseTest, flash_response_without_crc)
+{
+  usb_byte_t buffer[FLASH_RESPONSE_SIZE];
+
+  raw_packet raw_packet(buffer, FLASH_RESPONSE_SIZE);
+
+ auto flash_response_builder = *flash_response_builder::make_flash_response_builder(raw_packet);
+ flash_response_builder.set_response(flash_response_type::ACK);
+
+ // the buffer is too small for the crc
+ EXPECT_FALSE(flash_response_builder.set_crc(0xdf8a8a2b));
+
+ flash_response flash_response_packet(flash_response_builder);
+ EXPECT_FALSE(flash_response_packet.get_crc().has_value());
+
+ buffer[COMMON_FLASH_RESPONSE_LENGTH_POS] = 8;
+ EXPECT_FALSE(flash_response::make_flash_response(raw_packet).has_value());
 }
@@ -0,0 +1,66 @@
+#include "proto.hpp"
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+constexpr uint8_t COMMON_FLASH_VERIFY_LENGTH_POS = 0;
+constexpr uint8_t COMMON_FLASH_VERIFY_TYPE_POS   = 1;
+
+constexpr uint8_t FLASH_VERIFY_ADDR_POS = 2;
+constexpr uint8_t FLASH_VERIFY_SIZE_POS = 6;
+
+constexpr size_t  FLASH_VERIFY_SIZE     = 10;
+constexpr uint8_t FLASH_VERIFY_TYPE     = 0x07;
+
+} // namespace
+
+TEST(FlashVerifyTest, build_and_make_flash_verify_success)
+{
+ usb_byte_t buffer[FLASH_VERIFY_SIZE];
+
+ raw_packet raw_packet(buffer, FLASH_VERIFY_SIZE);
+
+ auto flash_verify_builder_opt = flash_verify_builder::make_flash_verify_builder(raw_packet);
+
+ ASSERT_TRUE(flash_verify_builder_opt.has_value());
+ EXPECT_EQ(buffer[COMMON_FLASH_VERIFY_LENGTH_POS], usb_byte_t{ FLASH_VERIFY_SIZE });
+ EXPECT_EQ(buffer[COMMON_FLASH_VERIFY_TYPE_POS], usb_byte_t{ FLASH_VERIFY_TYPE });
+
+ auto flash_verify_builder = *flash_verify_builder_opt;
+
+ flash_verify_builder.set_range(0x08004000, 0x4000);
+
+ EXPECT_EQ(buffer[FLASH_VERIFY_ADDR_POS + 1], usb_byte_t{ 0x40 });
+ EXPECT_EQ(buffer[FLASH_VERIFY_ADDR_POS + 3], usb_byte_t{ 0x08 });
+ EXPECT_EQ(buffer[FLASH_VERIFY_SIZE_POS + 1], usb_byte_t{ 0x40 });
+
+ flash_verify flash_verify_packet(flash_verify_builder);
+
+ // Pointers must be the same
+ EXPECT_EQ(flash_verify_packet.cdata(), buffer);
+ EXPECT_EQ(flash_verify_packet.begin(), buffer);
+ EXPECT_EQ(flash_verify_packet.end(), buffer + FLASH_VERIFY_SIZE);
+ EXPECT_EQ(flash_verify_packet.cend(), buffer + FLASH_VERIFY_SIZE);
+ EXPECT_EQ(flash_verify_packet.size(), FLASH_VERIFY_SIZE);
+
+ ASSERT_TRUE(flash_verify_packet.get_type().has_value());
+ EXPECT_EQ(uint8_t(flash_verify_packet.get_type().value()), FLASH_VERIFY_TYPE);
+
+ EXPECT_EQ(flash_verify_packet.get_addr(), 0x08004000u);
+ EXPECT_EQ(flash_verify_packet.get_size(), 0x4000u);
+
+ auto made_verify = flash_verify::make_flash_verify(raw_packet);
+ ASSERT_TRUE(made_verify.has_value());
+ EXPECT_EQ(made_verify->get_addr(), 0x08004000u);
+}
+
+TEST(FlashVerifyTest, make_flash_verify_wrong_length)
+{
+ usb_byte_t buffer[FLASH_VERIFY_SIZE] = { 2, FLASH_VERIFY_TYPE };
+
+ raw_packet raw_packet(buffer, FLASH_VERIFY_SIZE);
+
+ EXPECT_FALSE(flash_verify::make_flash_verify(raw_packet).has_value());
+}
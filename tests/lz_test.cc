@@ -0,0 +1,165 @@
+#include "lz.hpp"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace
+{
+
+// keeps the whole output, which is more than the decoder needs
+struct vector_sink
+{
+  std::vector<uint8_t> out;
+
+  void
+  put(uint8_t byte)
+  {
+    out.push_back(byte);
+  }
+
+  uint8_t
+  back(uint32_t distance) const
+  {
+    return out[out.size() - distance];
+  }
+};
+
+std::vector<uint8_t>
+compress(const std::vector<uint8_t> &data)
+{
+  std::vector<uint8_t> out(data.size() * 2 + 16);
+  auto size = lz_compress(data.data(), data.size(), out.data(), out.size());
+  EXPECT_TRUE(size.has_value());
+  out.resize(size.value_or(0));
+  return out;
+}
+
+// image like data: code, a lookup table, zeros and padding
+std::vector<uint8_t>
+image_like(size_t size)
+{
+  std::mt19937 rng(7);
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++)
+  {
+    if (i < size / 4)
+      data[i] = static_cast<uint8_t>(rng() % 16);
+    else if (i < size / 2)
+      data[i] = static_cast<uint8_t>(i % 64);
+    else if (i < size * 3 / 4)
+      data[i] = 0;
+    else
+      data[i] = 0xff;
+  }
+  return data;
+}
+
+} // namespace
+
+TEST(LzTest, round_trip_in_parts)
+{
+  const auto data = image_like(4096);
+  const auto stream = compress(data);
+  EXPECT_LT(stream.size(), data.size() / 2);
+
+  // the stream is fed in parts of bulk data size
+  lz_decoder decoder;
+  vector_sink sink;
+  decoder.reset(data.size());
+  for (size_t pos = 0; pos < stream.size(); pos += 252)
+  {
+    const size_t part = std::min<size_t>(stream.size() - pos, 252);
+    ASSERT_TRUE(decoder.feed(stream.data() + pos, part, sink));
+  }
+  EXPECT_TRUE(decoder.done());
+  EXPECT_EQ(sink.out, data);
+}
+
+TEST(LzTest, round_trip_byte_by_byte)
+{
+  std::mt19937 rng(3);
+  std::vector<uint8_t> data(1000);
+  for (auto &byte : data)
+    byte = static_cast<uint8_t>(rng() % 4);
+
+  const auto stream = compress(data);
+
+  lz_decoder decoder;
+  vector_sink sink;
+  decoder.reset(data.size());
+  for (const uint8_t byte : stream)
+    ASSERT_TRUE(decoder.feed(&byte, 1, sink));
+  EXPECT_TRUE(decoder.done());
+  EXPECT_EQ(sink.out, data);
+}
+
+TEST(LzTest, incompressible_data)
+{
+  std::mt19937 rng(5);
+  std::vector<uint8_t> data(512);
+  for (auto &byte : data)
+    byte = static_cast<uint8_t>(rng());
+
+  std::vector<uint8_t> out(data.size());
+  // only the literal tokens are added
+  EXPECT_FALSE(lz_compress(data.data(), data.size(), out.data(), out.size()).has_value());
+
+  const auto stream = compress(data);
+  EXPECT_EQ(stream.size(), data.size() + data.size() / lz_max_literal);
+}
+
+TEST(LzTest, run_of_one_byte)
+{
+  const std::vector<uint8_t> data(4096, 0);
+  const auto stream = compress(data);
+  // a literal followed by matches at distance 1
+  EXPECT_LT(stream.size(), 100u);
+  EXPECT_EQ(stream[0], 0);
+  EXPECT_EQ(stream[2] & lz_match_flag, lz_match_flag);
+  EXPECT_EQ(stream[3], 0);
+  EXPECT_EQ(stream[4], 0);
+}
+
+TEST(LzTest, padding_is_ignored)
+{
+  const auto data = image_like(256);
+  auto stream = compress(data);
+  stream.resize((stream.size() + 3) & ~size_t{3}, 0);
+  stream.resize(stream.size() + 4, 0);
+
+  lz_decoder decoder;
+  vector_sink sink;
+  decoder.reset(data.size());
+  EXPECT_TRUE(decoder.feed(stream.data(), stream.size(), sink));
+  EXPECT_TRUE(decoder.done());
+  EXPECT_EQ(sink.out, data);
+}
+
+TEST(LzTest, corrupt_stream)
+{
+  lz_decoder decoder;
+  vector_sink sink;
+
+  // match before the first byte
+  const uint8_t early_match[] = { lz_match_flag, 0, 0 };
+  decoder.reset(16);
+  EXPECT_FALSE(decoder.feed(early_match, sizeof(early_match), sink));
+
+  // literals beyond the size
+  const uint8_t long_literals[] = { 4, 1, 2, 3, 4, 5 };
+  decoder.reset(4);
+  EXPECT_FALSE(decoder.feed(long_literals, sizeof(long_literals), sink));
+
+  // match beyond the size
+  const uint8_t long_match[] = { 0, 1, lz_match_flag | 1, 0, 0 };
+  decoder.reset(4);
+  EXPECT_FALSE(decoder.feed(long_match, sizeof(long_match), sink));
+
+  // stream which ends too early
+  const uint8_t short_stream[] = { 1, 1, 2 };
+  decoder.reset(4);
+  EXPECT_TRUE(decoder.feed(short_stream, sizeof(short_stream), sink));
+  EXPECT_FALSE(decoder.done());
+}
@@ -5,7 +5,8 @@ STM_NACK=0x1F
 
 bootloader_ver=0x20
 bootloader_flash_size = 62000 #62KB
-flash_memory = [0]*bootloader_flash_size
+bootloader_page_size = 1024
+flash_memory = [0xff]*bootloader_flash_size
 flash_mem_base = 0x8000000
 
 with serial.Serial('/dev/ttyUSB0', baudrate=115200, bytesize=serial.EIGHTBITS, parity=serial.PARITY_EVEN, stopbits=serial.STOPBITS_ONE) as s:
@@ -55,6 +56,7 @@ with serial.Serial('/dev/ttyUSB0', baudrate=115200, bytesize=serial.EIGHTBITS, p
                 for b in program_piece:
                     flash_memory[i+mem_off] = b
                     program_chksum_gen = program_chksum_gen ^ b
+                    i += 1
 
                 if program_chksum_rec[0] != program_chksum_gen:
                     print("Invalid payload checksum {:x} != {:x}".format(program_chksum_gen, program_chksum_rec[0]))
@@ -65,14 +67,49 @@ with serial.Serial('/dev/ttyUSB0', baudrate=115200, bytesize=serial.EIGHTBITS, p
                 s.write(bytearray([STM_ACK]))
                 print("{} bytes flashed on address = {:x}".format(number_of_bytes[0]+1, addr_rev))
 
+            elif cmd[0] == 0x11 and cmd[1] == 0xee:
+                s.write(bytearray([STM_ACK]))
+                addr = s.read(4)
+                addr_chksum = s.read(1)
+                addr_rev = addr[0] << 24 | addr[1] << 16 | addr[2] << 8 | addr[3]
+                if addr_chksum[0] != addr[0] ^ addr[1] ^ addr[2] ^ addr[3]:
+                    print("Invalid address checksum")
+                    s.write(bytearray([STM_NACK]))
+                    continue
+
+                s.write(bytearray([STM_ACK]))
+                number_of_bytes = s.read(2)
+                if number_of_bytes[0] ^ number_of_bytes[1] != 0xff:
+                    s.write(bytearray([STM_NACK]))
+                    continue
+
+                s.write(bytearray([STM_ACK]))
+                mem_off = addr_rev - flash_mem_base
+                s.write(bytearray(flash_memory[mem_off:mem_off + number_of_bytes[0] + 1]))
+                print("{} bytes read from address = {:x}".format(number_of_bytes[0]+1, addr_rev))
+
             elif cmd[0] == 0x43 and cmd[1] == 0xbc:
                 s.write(bytearray([STM_ACK]))
                 num_of_pages = s.read(2)
                 if num_of_pages[0] == 0xff and num_of_pages[1] == 0x0:
-                    flash_memory = [0]*bootloader_flash_size
+                    flash_memory = [0xff]*bootloader_flash_size
+                    s.write(bytearray([STM_ACK]))
+                else:
+                    # N+1 page numbers followed by the checksum
+                    pages = num_of_pages[1:] + s.read(num_of_pages[0])
+                    pages_chksum = s.read(1)
+                    pages_chksum_gen = num_of_pages[0]
+                    for p in pages:
+                        pages_chksum_gen = pages_chksum_gen ^ p
+                    if pages_chksum[0] != pages_chksum_gen:
+                        print("Invalid pages checksum {:x} != {:x}".format(pages_chksum_gen, pages_chksum[0]))
+                        s.write(bytearray([STM_NACK]))
+                        continue
+                    for p in pages:
+                        start = p * bootloader_page_size
+                        flash_memory[start:start + bootloader_page_size] = [0xff]*bootloader_page_size
+                    print("Erased pages {}".format(list(pages)))
                     s.write(bytearray([STM_ACK]))
-                else: # only all pages erase command supported
-                    s.write(bytearray([STM_NACK]))
             elif cmd[0] == 0x3 and cmd[1] == 0xfc: # custom reset bootloader command
                 print("Reset done, exitng")
                 break